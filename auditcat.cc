@@ -0,0 +1,105 @@
+
+// Converts structured request logs (log_format = "binary") to JSON, one
+// object per line, ie. to ship them to a SIEM:
+//   auditcat.bin /tmp/totp_auth_20240301.audit [...]
+
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <arpa/inet.h>
+
+#include "auditlog.h"
+#include "metrics.h"
+
+static void json_str(std::string *out, std::string_view s) {
+	out->push_back('"');
+	for (unsigned char c : s) {
+		if (c == '"' || c == '\\') {
+			out->push_back('\\');
+			out->push_back(c);
+		}
+		else if (c < 0x20 || c >= 0x7f) {
+			char esc[8];
+			snprintf(esc, sizeof(esc), "\\u%04x", c);
+			*out += esc;
+		}
+		else
+			out->push_back(c);
+	}
+	out->push_back('"');
+}
+
+static std::string to_json(const audit_rec_t &rec, std::string_view host, std::string_view user) {
+	char ts[64], ip[INET6_ADDRSTRLEN];
+	time_t secs = rec.time_us / 1000000;
+	struct tm tm;
+	gmtime_r(&secs, &tm);
+	size_t n = strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", &tm);
+	snprintf(ts + n, sizeof(ts) - n, ".%06uZ", (unsigned)(rec.time_us % 1000000));
+
+	// IPv4 mapped addresses are shown as plain IPv4
+	static const uint8_t v4prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+	if (!memcmp(rec.ip, v4prefix, sizeof(v4prefix)))
+		inet_ntop(AF_INET, &rec.ip[12], ip, sizeof(ip));
+	else
+		inet_ntop(AF_INET6, rec.ip, ip, sizeof(ip));
+
+	std::string ret = std::string("{\"time\":\"") + ts + "\",\"event\":\"" +
+		(rec.event < aeCount ? audit_events[rec.event] : "unknown") + "\",\"endpoint\":\"" +
+		(rec.endpoint < epCount ? metric_endpoints[rec.endpoint] : "unknown") + "\",\"status\":" +
+		std::to_string(rec.status) + ",\"host\":";
+	json_str(&ret, host);
+	if (rec.uid != ~0U)
+		ret += ",\"uid\":" + std::to_string(rec.uid);
+	if (!user.empty()) {
+		ret += ",\"user\":";
+		json_str(&ret, user);
+	}
+	ret += std::string(",\"ip\":\"") + ip + "\",\"latency_us\":" + std::to_string(rec.latency_us) + "}\n";
+	return ret;
+}
+
+static int convert(const char *fn) {
+	std::ifstream ifs(fn, std::ios::binary);
+	std::string data((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+	if (!ifs.good() && !ifs.eof()) {
+		std::cerr << "Could not read " << fn << std::endl;
+		return 1;
+	}
+	if (data.compare(0, 8, AUDIT_MAGIC)) {
+		std::cerr << fn << " is not an audit log" << std::endl;
+		return 1;
+	}
+
+	size_t pos = 8;
+	while (pos + sizeof(audit_rec_t) <= data.size()) {
+		audit_rec_t rec;
+		memcpy(&rec, &data[pos], sizeof(rec));
+		if (!rec.len) {
+			// Padding, records go on at the next block
+			pos = (pos + AUDIT_BLOCK) & ~(size_t)(AUDIT_BLOCK - 1);
+			continue;
+		}
+		if (rec.len != sizeof(rec) + rec.hostlen + rec.userlen || pos + rec.len > data.size()) {
+			std::cerr << fn << ": corrupt record at offset " << pos << std::endl;
+			return 1;
+		}
+		std::string_view host(&data[pos + sizeof(rec)], rec.hostlen);
+		std::string_view user(&data[pos + sizeof(rec) + rec.hostlen], rec.userlen);
+		std::cout << to_json(rec, host, user);
+		pos += rec.len;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		std::cerr << "Usage: " << argv[0] << " file.audit [...]" << std::endl;
+		return 1;
+	}
+	int ret = 0;
+	for (int i = 1; i < argc; i++)
+		ret |= convert(argv[i]);
+	return ret;
+}
+
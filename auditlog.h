@@ -0,0 +1,301 @@
+
+#ifndef __AUDITLOG__HH__
+#define __AUDITLOG__HH__
+
+#include <mutex>
+#include <ctime>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <string_view>
+#include <condition_variable>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "logger.h"
+
+// Structured request log: one binary record per request, which is way
+// cheaper to produce than a text line and doesn't need parsing afterwards
+// (auditcat.bin converts the files to JSON). Records are appended to per
+// thread rings, like the text log, and a background thread batches them
+// into direct (O_DIRECT, when supported) block aligned writes, so the page
+// cache isn't filled with log data.
+// File layout: AUDIT_MAGIC, then records (host byte order). A record with
+// zero length means padding up to the next AUDIT_BLOCK boundary.
+
+#define AUDIT_MAGIC      "TOTPAUD1"
+#define AUDIT_BLOCK      4096
+#define AUDIT_MAX_STR    255
+
+enum aEvent : uint8_t {
+	aeRequest,       // Nothing special about it (ie. login page)
+	aeAuthOk, aeAuthDenied, aeRateLimited,
+	aeLoginOk, aeLoginFailed, aeLoginBusy,
+	aeLogout, aeLogoutAll,
+	aeUnknownHost, aeNotFound,
+	aeCount
+};
+
+static const char * const audit_events[aeCount] = {
+	"request", "auth_ok", "auth_denied", "rate_limited",
+	"login_ok", "login_failed", "login_busy",
+	"logout", "logout_all", "unknown_host", "not_found"
+};
+
+struct audit_rec_t {
+	uint16_t len;             // Whole record, strings included
+	uint8_t event;            // aEvent
+	uint8_t endpoint;         // mEndpoint
+	uint16_t status;          // HTTP status code
+	uint8_t hostlen;          // Hostname and username follow the record
+	uint8_t userlen;
+	uint64_t time_us;         // Unix time (microseconds)
+	uint8_t ip[16];           // Source address (IPv4 mapped into IPv6)
+	uint32_t uid;             // User id within the host (~0 if unknown)
+	uint32_t latency_us;      // Since the request was accepted
+};
+
+// What request processing found out, logged once it's done
+struct audit_event_t {
+	aEvent event = aeRequest;
+	unsigned uid = ~0U;
+	std::string user;
+};
+
+class AuditLog {
+public:
+	// Files are named logfile_YYYYmmdd.audit, every logging thread gets a
+	// ring of ringsize bytes (records that don't fit are dropped). Write
+	// errors are counted in metrics (if any).
+	AuditLog(std::string logfile, size_t ringsize = 256*1024, Metrics *metrics = nullptr)
+	 : metrics(metrics), logfile(logfile) {
+		this->ringsize = 4096;
+		while (this->ringsize < ringsize)
+			this->ringsize <<= 1;
+
+		// Twice the ring at least, so a ring always fits after writing out
+		bufsize = std::max((size_t)1 << 20, this->ringsize * 2);
+		buf = (char*)aligned_alloc(AUDIT_BLOCK, bufsize);
+
+		rotatelog();
+		flusher = std::thread(&AuditLog::flushthread, this);
+	}
+
+	~AuditLog() {
+		{
+			std::unique_lock<std::mutex> lock(waitmu);
+			end = true;
+		}
+		waitcond.notify_all();
+		flusher.join();
+		if (logfd >= 0)
+			close(logfd);
+		free(buf);
+	}
+
+	// Pins the flusher thread (see pin_thread)
+	void pin(const std::vector<int> &cpus) {
+		pin_thread(flusher.native_handle(), cpus);
+	}
+
+	void log(aEvent event, unsigned endpoint, unsigned status, std::string_view host, std::string_view user,
+	         const uint8_t *ip, unsigned uid, uint64_t latency_ns) {
+		host = host.substr(0, AUDIT_MAX_STR);
+		user = user.substr(0, AUDIT_MAX_STR);
+		ring_t *r = myring();
+		size_t need = sizeof(audit_rec_t) + host.size() + user.size();
+		size_t head = r->head.load(std::memory_order_relaxed);
+		size_t used = head - r->tail.load(std::memory_order_acquire);
+		if (used + need > ringsize) {
+			r->dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		audit_rec_t rec = {
+			.len = (uint16_t)need, .event = event, .endpoint = (uint8_t)endpoint, .status = (uint16_t)status,
+			.hostlen = (uint8_t)host.size(), .userlen = (uint8_t)user.size(),
+			.time_us = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::system_clock::now().time_since_epoch()).count(),
+			.ip = {}, .uid = uid, .latency_us = (uint32_t)std::min(latency_ns / 1000, (uint64_t)UINT32_MAX) };
+		memcpy(rec.ip, ip, sizeof(rec.ip));
+		put(r, head, &rec, sizeof(rec));
+		put(r, head + sizeof(rec), host.data(), host.size());
+		put(r, head + sizeof(rec) + host.size(), user.data(), user.size());
+		r->head.store(head + need, std::memory_order_release);
+
+		if (used + need > ringsize / 2)
+			waitcond.notify_all();
+	}
+
+	// Number of records dropped so far due to full buffers
+	uint64_t dropped() {
+		std::lock_guard<std::mutex> guard(ringsmu);
+		uint64_t ret = 0;
+		for (const auto & r : rings)
+			ret += r->dropped.load(std::memory_order_relaxed);
+		return ret;
+	}
+
+private:
+	// Single producer (owner thread) single consumer (flusher) byte ring
+	struct ring_t {
+		std::unique_ptr<char[]> buf;
+		alignas(64) std::atomic<size_t> head{0};
+		alignas(64) std::atomic<size_t> tail{0};
+		std::atomic<uint64_t> dropped{0};
+	};
+
+	ring_t *myring() {
+		// Keyed by instance id, a new logger may reuse the address of an old one
+		static thread_local uint64_t owner = 0;
+		static thread_local ring_t *ring = nullptr;
+		if (owner != id) {
+			std::unique_ptr<ring_t> r(new ring_t());
+			r->buf.reset(new char[ringsize]);
+			ring = r.get();
+			owner = id;
+			std::lock_guard<std::mutex> guard(ringsmu);
+			rings.push_back(std::move(r));
+		}
+		return ring;
+	}
+
+	void put(ring_t *r, size_t pos, const void *data, size_t len) {
+		size_t off = pos & (ringsize - 1);
+		size_t first = std::min(len, ringsize - off);
+		memcpy(&r->buf[off], data, first);
+		memcpy(&r->buf[0], (const char*)data + first, len - first);
+	}
+
+	// Writes the buffered blocks, the last one zero padded. Complete blocks
+	// are dropped from the buffer, the partial one is rewritten next time.
+	bool writeout() {
+		size_t len = (fill + AUDIT_BLOCK - 1) & ~(size_t)(AUDIT_BLOCK - 1);
+		memset(&buf[fill], 0, len - fill);
+		bool ok = true;
+		for (size_t done = 0; done < len; ) {
+			ssize_t w = pwrite(logfd, &buf[done], len - done, fileoff + done);
+			if (w <= 0) {
+				if (metrics)
+					metrics->inc(ctAuditWriteErrors);
+				ok = false;
+				break;
+			}
+			done += w;
+		}
+		size_t whole = fill & ~(size_t)(AUDIT_BLOCK - 1);
+		memmove(&buf[0], &buf[whole], fill - whole);
+		fileoff += whole;
+		fill -= whole;
+		return ok;
+	}
+
+	void rotatelog() {
+		std::string today = logts(true);
+		if (logdate == today && logfd >= 0)
+			return;
+		if (logfd >= 0) {
+			writeout();
+			close(logfd);
+		}
+
+		logdate = today;
+		std::string fn = logfile + "_" + logdate + ".audit";
+		logfd = open(fn.c_str(), O_WRONLY | O_CREAT | O_DIRECT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+		if (logfd < 0)   // Ie. tmpfs doesn't do direct IO
+			logfd = open(fn.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+
+		// Appends start at a block boundary (the reader skips the padding)
+		struct stat st;
+		fill = 0;
+		fileoff = 0;
+		if (logfd >= 0 && !fstat(logfd, &st))
+			fileoff = (st.st_size + AUDIT_BLOCK - 1) & ~(off_t)(AUDIT_BLOCK - 1);
+		if (!fileoff) {
+			memcpy(buf, AUDIT_MAGIC, 8);
+			fill = 8;
+		}
+		next_rotation = last_midnight() + 24*60*60;
+	}
+
+	// Moves whatever the rings hold into the buffer and writes it out
+	bool drain() {
+		std::vector<ring_t*> rs;
+		{
+			std::lock_guard<std::mutex> guard(ringsmu);
+			for (const auto & r : rings)
+				rs.push_back(r.get());
+		}
+
+		bool ok = true;
+		for (ring_t *r : rs) {
+			size_t tail = r->tail.load(std::memory_order_relaxed);
+			size_t len = r->head.load(std::memory_order_acquire) - tail;
+			if (fill + len > bufsize)
+				ok &= writeout();
+			size_t off = tail & (ringsize - 1);
+			size_t first = std::min(len, ringsize - off);
+			memcpy(&buf[fill], &r->buf[off], first);
+			memcpy(&buf[fill + first], &r->buf[0], len - first);
+			fill += len;
+			r->tail.store(tail + len, std::memory_order_release);
+		}
+		if (fill)
+			ok &= writeout();
+		return ok;
+	}
+
+	void flushthread() {
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(waitmu);
+				if (!end)
+					waitcond.wait_for(lock, std::chrono::milliseconds(LOG_FLUSH_MS));
+			}
+
+			if (time(NULL) > next_rotation)
+				rotatelog();
+
+			// Records logged before the end was signaled must be drained
+			bool last = end;
+			bool ok = logfd >= 0 && drain();
+			if (last && (ok || ++failures > 3))
+				break;
+		}
+	}
+
+	// Per thread buffers
+	static uint64_t next_id() {
+		static std::atomic<uint64_t> ids{0};
+		return ++ids;
+	}
+	const uint64_t id = next_id();
+	std::vector<std::unique_ptr<ring_t>> rings;
+	std::mutex ringsmu;
+	size_t ringsize;
+
+	// Block aligned batch, fill bytes of it go at fileoff
+	char *buf;
+	size_t bufsize, fill = 0;
+	off_t fileoff = 0;
+
+	std::thread flusher;
+	std::mutex waitmu;
+	std::condition_variable waitcond;
+	std::atomic<bool> end{false};
+	unsigned failures = 0;
+
+	Metrics *metrics;
+	std::string logfile, logdate;
+	int logfd = -1;
+	time_t next_rotation = 0;
+};
+
+#endif
+
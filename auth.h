@@ -0,0 +1,352 @@
+
+#ifndef __AUTH__HH__
+#define __AUTH__HH__
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <charconv>
+#include <ctime>
+#include <cstring>
+#include <memory>
+#include <atomic>
+#include <openssl/crypto.h>
+
+#include "util.h"
+#include "hmac.h"
+#include "cookiecache.h"
+#include "flatmap.h"
+#include "password.h"
+#include "revoke.h"
+
+// Credentials, TOTP validation and authentication cookies
+
+#define TOTP_DEF_DIGITS         6
+#define TOTP_DEF_PERIOD        30
+#define TOTP_DEF_GENS           1      // Allows a window of 90s by default
+#define TOTP_DEF_ALGO      "sha1"
+#define TOTP_MAX_WINDOW        17      // Max cached codes (generations up to 8)
+
+enum htAlgo {
+	hAlgoSha1    = 0,
+	hAlgoSha256  = 1,
+	hAlgoSha512  = 2
+};
+
+const std::unordered_map<std::string, htAlgo> algnames = {
+	{"sha1",    hAlgoSha1},
+	{"sha-256", hAlgoSha256},
+	{"sha-512", hAlgoSha512},
+};
+
+static inline const EVP_MD *algo_md(htAlgo algo) {
+	const EVP_MD *(* const algtbl[])() = {
+		EVP_sha1, EVP_sha256, EVP_sha512
+	};
+	return algtbl[(unsigned)algo]();
+}
+
+// Expected codes for the current window of a user (the same for every
+// attempt within a period), so that repeated attempts against an account
+// don't recompute the HMACs. Readers don't lock: it's a seqlock, and the
+// odd writer that loses the race simply doesn't update it.
+struct alignas(64) totp_window_t {
+	std::atomic<uint32_t> seq{0};          // Odd while being written
+	std::atomic<uint32_t> step{0};         // Time step the window is centered at
+	std::atomic<uint32_t> gens{0};         // Window generations
+	std::atomic<uint32_t> codes[TOTP_MAX_WINDOW];
+
+	bool read(uint32_t ct, unsigned generations, uint32_t *out) const {
+		uint32_t s = seq.load(std::memory_order_acquire);
+		if ((s & 1) || step.load(std::memory_order_relaxed) != ct ||
+		    gens.load(std::memory_order_relaxed) != generations)
+			return false;
+		for (unsigned i = 0; i < generations * 2 + 1; i++)
+			out[i] = codes[i].load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return seq.load(std::memory_order_relaxed) == s;
+	}
+
+	void write(uint32_t ct, unsigned generations, const uint32_t *in) {
+		uint32_t s = seq.load(std::memory_order_relaxed);
+		if ((s & 1) || !seq.compare_exchange_strong(s, s + 1, std::memory_order_relaxed))
+			return;
+		std::atomic_thread_fence(std::memory_order_release);
+		step.store(ct, std::memory_order_relaxed);
+		gens.store(generations, std::memory_order_relaxed);
+		for (unsigned i = 0; i < generations * 2 + 1; i++)
+			codes[i].store(in[i], std::memory_order_relaxed);
+		seq.store(s + 2, std::memory_order_release);
+	}
+};
+
+struct cred_t {
+	PasswordHash password;       // Password (plain text or hash)
+	HmacKey totp;                // TOTP key (pre-keyed HMAC)
+	unsigned sduration;          // Duration of a valid session (seconds)
+	unsigned digits;             // Digits of TOTP
+	unsigned period;             // Period of TOTP
+	htAlgo algorithm;            // TOTP hashing algorithm
+	unsigned uid;                // Index in the users table (used in cookies)
+	std::shared_ptr<totp_window_t> window;   // Cached codes (optional)
+	std::atomic<int64_t> *notbefore = nullptr;  // Revocation time (optional)
+};
+
+typedef FlatMap<cred_t> users_t;   // User to credential
+
+static inline unsigned totp_calc(const HmacKey &key, uint8_t digits, uint32_t epoch) {
+	const uint32_t po10[] = {
+		1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
+	// Key is already keyed with the binary seed and the right algorithm
+	// Concatenate the epoc in big endian fashion
+	uint8_t msg [8] = {
+		0, 0, 0, 0,
+		(uint8_t)(epoch >> 24),
+		(uint8_t)((epoch >> 16) & 255),
+		(uint8_t)((epoch >>  8) & 255),
+		(uint8_t)(epoch & 255)
+	};
+
+	uint8_t hash[EVP_MAX_MD_SIZE];
+	unsigned hsize = key.sign(msg, sizeof(msg), hash);
+
+	// The last nibble of the hash is an offset:
+	unsigned off = hash[hsize - 1] & 15;
+	// The result is a substr in hash at that offset (pick 32 bits)
+	uint32_t value = (hash[off] << 24) | (hash[off+1] << 16) | (hash[off+2] << 8) | hash[off+3];
+	value &= 0x7fffffff;
+	return value % po10[digits];
+}
+
+static inline bool totp_valid(const cred_t &user, unsigned input, unsigned generations) {
+	uint32_t ct = time(0) / user.period;
+	uint32_t codes[TOTP_MAX_WINDOW];
+	unsigned n = generations * 2 + 1;
+	bool cacheable = user.window && n <= TOTP_MAX_WINDOW;
+	if (!cacheable || !user.window->read(ct, generations, codes)) {
+		uint32_t match = 0;
+		for (unsigned i = 0; i < n; i++) {
+			uint32_t code = totp_calc(user.totp, user.digits, ct + i - generations);
+			if (cacheable)
+				codes[i] = code;
+			match |= (code == input);
+		}
+		if (cacheable)
+			user.window->write(ct, generations, codes);
+		return match;
+	}
+
+	// Compare against all of them, without an early exit
+	uint32_t match = 0;
+	for (unsigned i = 0; i < n; i++) {
+		uint32_t diff = codes[i] ^ input;
+		match |= ((diff | -diff) >> 31) ^ 1;
+	}
+	return match;
+}
+
+// Cookie formats: the legacy text one, etime:hex(user):hex(hmac_sha1), and
+// the compact one, base64url of a fixed layout binary record:
+//   version (1) | user id (4, BE) | issue time (4, BE) | hmac_sha256 (16)
+// The user id is the user index in the host config, the HMAC covers the
+// record fields and the username, so that a token never maps to a different
+// user if ids change (ie. users are reordered in the config).
+#define COOKIE_V1            1
+#define COOKIE_HDR_LEN       9
+#define COOKIE_MAC_LEN      16
+#define COOKIE_BIN_LEN     (COOKIE_HDR_LEN + COOKIE_MAC_LEN)
+#define COOKIE_MAX_USER    256   // Longer usernames use legacy cookies
+
+// Keys derived from the server secret
+struct cookie_keys_t {
+	HmacKey legacy;     // HMAC-SHA1, legacy cookies
+	HmacKey compact;    // HMAC-SHA256, compact cookies
+
+	cookie_keys_t(std::string_view secret)
+	 : legacy(EVP_sha1(), secret), compact(EVP_sha256(), secret) {}
+};
+
+// Issues and validates authentication cookies
+class CookieAuth {
+public:
+	// What a cookie decodes to, which is what revocations are keyed on: the
+	// record (compact) or the issue time and HMAC (legacy). Unlike the cookie
+	// text, a session has only one of these.
+	struct session_id_t {
+		uint8_t data[COOKIE_BIN_LEN + EVP_MAX_MD_SIZE];
+		unsigned len = 0;
+
+		std::string_view view() const { return std::string_view((const char*)data, len); }
+	};
+
+	// Issues compact cookies unless told otherwise, validates both formats
+	CookieAuth(const cookie_keys_t *keys, CookieCache *cc, bool compact = true, RevocationList *rev = nullptr)
+	 : keys(keys), cc(cc), compact(compact), rev(rev) {}
+
+	std::string create(const std::string &user, const cred_t &cred) const {
+		if (!compact || user.size() > COOKIE_MAX_USER) {
+			std::string payload = std::to_string(time(0)) + ":" + hexencodesv(user);
+			return payload + ":" + hexencodesv(keys->legacy.sign(payload));
+		}
+
+		uint8_t rec[COOKIE_BIN_LEN];
+		put_header(rec, cred.uid, time(0));
+		sign_compact(rec, user, rec + COOKIE_HDR_LEN);
+		return b64urlencode(rec, sizeof(rec));
+	}
+
+	// Returns true if the cookie is good. gen identifies the config users
+	// belongs to, so that cached results don't survive a reload.
+	bool check(std::string_view cookie, std::string_view host, const users_t &users, uint32_t gen = 0) {
+		// Fast path, recently validated cookies are in the cache. Revoking
+		// users changes the tag too, revoked tokens are checked every time.
+		time_t now = time(0);
+		uint32_t tag = !rev ? gen : gen ^ (rev->serial() * 0x9e3779b9U);
+		if (cc->lookup(cookie, host, now, tag)) {
+			// It decoded fine already, when it was verified
+			session_id_t sid;
+			return !rev || !rev->any_tokens() || !decode(cookie, &sid) || !rev->token_revoked(sid.view());
+		}
+
+		time_t expiry;
+		if (!owner(cookie, users, now, &expiry))
+			return false;
+		cc->insert(cookie, host, expiry, tag);
+		return true;
+	}
+
+	// Credential a valid cookie belongs to (no cache involved), or nullptr.
+	// The session it stands for goes in sid (if given).
+	const cred_t *owner(std::string_view cookie, const users_t &users, time_t now, time_t *expiry,
+	                    session_id_t *sid = nullptr) {
+		session_id_t id;
+		sid = sid ?: &id;
+		if (!decode(cookie, sid))
+			return nullptr;
+		const cred_t *cred = cookie.find(':') == std::string_view::npos ?
+		                     check_compact(*sid, users, now, expiry) :
+		                     check_legacy(cookie, *sid, users, now, expiry);
+		if (cred && rev && rev->token_revoked(sid->view()))
+			return nullptr;
+		return cred;
+	}
+
+private:
+	static void put_header(uint8_t *rec, uint32_t uid, uint32_t ts) {
+		rec[0] = COOKIE_V1;
+		for (unsigned i = 0; i < 4; i++) {
+			rec[1 + i] = uid >> (24 - i * 8);
+			rec[5 + i] = ts >> (24 - i * 8);
+		}
+	}
+
+	// HMAC of the record header followed by the username, truncated
+	void sign_compact(const uint8_t *rec, std::string_view user, uint8_t *mac) const {
+		uint8_t msg[COOKIE_HDR_LEN + COOKIE_MAX_USER], hmac[EVP_MAX_MD_SIZE];
+		memcpy(msg, rec, COOKIE_HDR_LEN);
+		memcpy(&msg[COOKIE_HDR_LEN], user.data(), user.size());
+		keys->compact.sign(msg, COOKIE_HDR_LEN + user.size(), hmac);
+		memcpy(mac, hmac, COOKIE_MAC_LEN);
+	}
+
+	// Sessions of revoked users are not valid if issued up to the revocation
+	static bool revoked(const cred_t &cred, int64_t issued) {
+		return cred.notbefore && issued <= cred.notbefore->load(std::memory_order_acquire);
+	}
+
+	// Decodes a cookie (either format) without verifying anything
+	static bool decode(std::string_view cookie, session_id_t *sid) {
+		auto p1 = cookie.find(':');
+		if (p1 == std::string::npos) {
+			sid->len = COOKIE_BIN_LEN;
+			return b64urldecode(cookie, sid->data, sizeof(sid->data)) == COOKIE_BIN_LEN &&
+			       sid->data[0] == COOKIE_V1;
+		}
+
+		// The cookie format is something like:
+		// etime:hex(user):hex(hmac)
+		auto p2 = cookie.find(':', p1 + 1);
+		if (p2 == std::string::npos)
+			return false;
+		uint64_t ets = 0;
+		std::from_chars(cookie.data(), cookie.data() + p1, ets);
+		for (unsigned i = 0; i < 8; i++)
+			sid->data[i] = ets >> (56 - i * 8);
+		// Lowercase only (as issued), hexdecode takes anything
+		std::string_view hexmac = cookie.substr(p2+1);
+		for (char c : hexmac) {
+			if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f')))
+				return false;
+		}
+		int hmaclen = hexdecode(hexmac, &sid->data[8], EVP_MAX_MD_SIZE);
+		sid->len = 8 + hmaclen;
+		return hmaclen > 0;
+	}
+
+	const cred_t *check_compact(const session_id_t &sid, const users_t &users, time_t now, time_t *expiry) const {
+		const uint8_t *rec = sid.data;
+		uint32_t uid = 0, ets = 0;
+		for (unsigned i = 0; i < 4; i++) {
+			uid = (uid << 8) | rec[1 + i];
+			ets = (ets << 8) | rec[5 + i];
+		}
+
+		const auto *entry = users.at(uid);
+		if (!entry || entry->key.size() > COOKIE_MAX_USER)
+			return nullptr;
+		// Not valid if the cookie is too old
+		*expiry = (time_t)ets + entry->value.sduration;
+		if (now > *expiry || revoked(entry->value, ets))
+			return nullptr;
+
+		uint8_t mac[COOKIE_MAC_LEN];
+		sign_compact(rec, entry->key, mac);
+		return CRYPTO_memcmp(mac, rec + COOKIE_HDR_LEN, COOKIE_MAC_LEN) ? nullptr : &entry->value;
+	}
+
+	// The session id holds the decoded issue time and HMAC
+	const cred_t *check_legacy(std::string_view cookie, const session_id_t &sid, const users_t &users,
+	                           time_t now, time_t *expiry) {
+		auto p1 = cookie.find(':');
+		auto p2 = cookie.find(':', p1 + 1);
+		uint64_t ets = 0;
+		for (unsigned i = 0; i < 8; i++)
+			ets = (ets << 8) | sid.data[i];
+		hexdecode(cookie.substr(p1+1, p2-p1-1), &userbuf);
+		const uint8_t *hmac = &sid.data[8];
+		int hmaclen = sid.len - 8;
+		// Lookup by username
+		const cred_t *cred = users.find(userbuf);
+		if (!cred)
+			return nullptr;
+		unsigned duration = cred->sduration;
+		// Not valid if the cookie is too old
+		if ((unsigned)now > ets + duration || revoked(*cred, ets))
+			return nullptr;
+		// Finally check the HMAC with the secret to ensure the cookie is valid
+		uint8_t hmac_calc[EVP_MAX_MD_SIZE];
+		int hsize = keys->legacy.sign(cookie.data(), p2, hmac_calc);
+		if (hmaclen != hsize || CRYPTO_memcmp(hmac, hmac_calc, hsize))
+			return nullptr;
+
+		*expiry = ets + duration;
+		return cred;
+	}
+
+	// Keys derived from the secret 'random' string, used to authenticate cookies
+	const cookie_keys_t *keys;
+
+	// Recently verified cookies
+	CookieCache* const cc;
+
+	// Issue compact cookies
+	bool compact;
+
+	// Revoked users and tokens (optional)
+	RevocationList *rev;
+
+	// Scratch buffer, reused across calls to avoid allocations
+	std::string userbuf;
+};
+
+#endif
@@ -0,0 +1,105 @@
+
+#ifndef __AUTOSCALE__HH__
+#define __AUTOSCALE__HH__
+
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <condition_variable>
+#include <sched.h>
+#include <sys/resource.h>
+
+#include "queue.h"
+#include "metrics.h"
+
+// Adapts the number of workers taking requests (between min and max) to
+// the load. Every interval it looks at how long requests waited in the
+// queue on average: above the target for a couple of intervals in a row
+// a quarter more workers are let in (unless the process already uses all
+// the CPUs it can run on, where more threads wouldn't help). Well below it,
+// with workers mostly idle, one worker at a time is parked again, but only
+// after a longer calm period so that it doesn't oscillate.
+
+#define SCALE_UP_AFTER         2     // Intervals over the target
+#define SCALE_DOWN_AFTER      10     // Calm intervals
+#define SCALE_DOWN_BUSY      0.5     // Max fraction of time workers are busy
+
+class PoolScaler {
+public:
+	PoolScaler(WorkerGate *gate, Metrics *metrics, unsigned minw, unsigned maxw, uint64_t target_ns,
+	           unsigned interval_ms)
+	 : gate(gate), metrics(metrics), minw(minw), maxw(maxw), target_ns(target_ns),
+	   interval_ms(std::max(interval_ms, 10U)) {
+		cpu_set_t set;
+		ncpus = !sched_getaffinity(0, sizeof(set), &set) ? CPU_COUNT(&set) : 1;
+		metrics->set_workers(gate->count());
+		thread = std::thread(&PoolScaler::run, this);
+	}
+
+	~PoolScaler() {
+		{
+			std::lock_guard<std::mutex> lock(mu);
+			end = true;
+		}
+		cond.notify_all();
+		thread.join();
+	}
+
+private:
+	static uint64_t cpu_ns() {
+		struct rusage ru;
+		getrusage(RUSAGE_SELF, &ru);
+		return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+		       (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+	}
+
+	void run() {
+		uint64_t reqs = 0, wait = 0, busy = 0, cpu = cpu_ns(), last = mono_ns();
+		metrics->load(&reqs, &wait, &busy);
+		unsigned over = 0, calm = 0;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(mu);
+				cond.wait_for(lock, std::chrono::milliseconds(interval_ms), [this] { return end; });
+				if (end)
+					return;
+			}
+
+			uint64_t nreqs, nwait, nbusy, ncpu = cpu_ns(), now = mono_ns();
+			metrics->load(&nreqs, &nwait, &nbusy);
+			uint64_t dreqs = nreqs - reqs, elapsed = std::max(now - last, (uint64_t)1);
+			double avg_wait = dreqs ? (double)(nwait - wait) / dreqs : 0;
+			unsigned active = gate->count();
+			double busyness = (double)(nbusy - busy) / ((double)elapsed * active);
+			double cpuload = (double)(ncpu - cpu) / ((double)elapsed * ncpus);
+			reqs = nreqs, wait = nwait, busy = nbusy, cpu = ncpu, last = now;
+
+			over = avg_wait > target_ns ? over + 1 : 0;
+			calm = avg_wait < target_ns / 4 && busyness < SCALE_DOWN_BUSY ? calm + 1 : 0;
+			unsigned next = active;
+			if (over >= SCALE_UP_AFTER && cpuload < 0.9)
+				next = std::min(maxw, active + std::max(active / 4, 1U));
+			else if (calm >= SCALE_DOWN_AFTER)
+				next = std::max(minw, active - 1);
+			if (next != active) {
+				gate->set(next);
+				metrics->set_workers(next);
+				over = calm = 0;
+			}
+		}
+	}
+
+	WorkerGate *gate;
+	Metrics *metrics;
+	unsigned minw, maxw;
+	uint64_t target_ns;
+	unsigned interval_ms, ncpus;
+	std::thread thread;
+	std::mutex mu;
+	std::condition_variable cond;
+	bool end = false;
+};
+
+#endif
+
@@ -0,0 +1,297 @@
+
+// FastCGI load generator, talks the protocol directly to the server socket
+// (as nginx would) replaying a mix of /auth hits and /login GETs and POSTs.
+// Reports throughput and latency percentiles.
+//
+// Usage: loadgen.bin -s /path/to/sock|host:port [options]
+//   -c N          Concurrent clients (one thread each, default 4)
+//   -d SECS       Duration of the run (default 10)
+//   -m A,L,P      Weights of /auth, /login GET and /login POST (default 90,5,5)
+//   -H host       Host header to send (default someweb.example.com)
+//   -S secret     Server secret, used to mint valid cookies for /auth
+//   -i uid        Mint compact cookies for this user id (its position in the
+//                 host users list, starting at 0), legacy cookies otherwise
+//   -u user       User for the minted cookies and logins (default user1)
+//   -p pass       Password for logins
+//   -t base32     TOTP seed for logins (otherwise sends wrong codes)
+//   -k            Keep connections open (FCGI_KEEP_CONN) across requests
+//   -l label      Label printed along with the results (ie. nthreads=8)
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../util.h"
+#include "../hmac.h"
+#include "../auth.h"
+
+#define FCGI_BEGIN_REQUEST   1
+#define FCGI_END_REQUEST     3
+#define FCGI_PARAMS          4
+#define FCGI_STDIN           5
+#define FCGI_STDOUT          6
+#define FCGI_RESPONDER       1
+#define FCGI_KEEP_CONN       1
+
+struct opts_t {
+	std::string sock, host = "someweb.example.com", user = "user1", pass, label;
+	std::string cookie, totpseed;
+	unsigned clients = 4, duration = 10;
+	unsigned weights[3] = {90, 5, 5};
+	bool keepconn = false;
+};
+
+struct result_t {
+	std::vector<uint32_t> lat_us;    // Latency of every completed request
+	uint64_t errors = 0;             // Connection or protocol errors
+	uint64_t status[6] = {0};        // 2xx, 3xx, 4xx (not 429), 429, 5xx, other
+};
+
+static int dial(const std::string &addr) {
+	int fd;
+	if (addr.find(':') == std::string::npos) {
+		struct sockaddr_un sa = {};
+		sa.sun_family = AF_UNIX;
+		strncpy(sa.sun_path, addr.c_str(), sizeof(sa.sun_path) - 1);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd >= 0 && connect(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	auto p = addr.rfind(':');
+	struct addrinfo hints = {}, *res;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(addr.substr(0, p).c_str(), addr.substr(p + 1).c_str(), &hints, &res))
+		return -1;
+	fd = socket(res->ai_family, SOCK_STREAM, 0);
+	if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+static void record(std::string *out, uint8_t type, std::string_view content) {
+	uint8_t hdr[8] = { 1, type, 0, 1,
+		(uint8_t)(content.size() >> 8), (uint8_t)(content.size() & 255), 0, 0 };
+	out->append((char*)hdr, sizeof(hdr));
+	out->append(content);
+}
+
+static void param(std::string *out, std::string_view name, std::string_view value) {
+	for (size_t l : {name.size(), value.size()}) {
+		if (l < 128)
+			out->push_back((char)l);
+		else {
+			out->push_back((char)(0x80 | (l >> 24)));
+			out->push_back((char)((l >> 16) & 255));
+			out->push_back((char)((l >> 8) & 255));
+			out->push_back((char)(l & 255));
+		}
+	}
+	out->append(name);
+	out->append(value);
+}
+
+// Builds the whole request (all records) as nginx would send it
+static std::string build_request(const opts_t &o, unsigned kind) {
+	std::string body;
+	if (kind == 2) {
+		unsigned code = 0;
+		if (!o.totpseed.empty()) {
+			HmacKey key(EVP_sha1(), b32dec(b32pad(o.totpseed)));
+			code = totp_calc(key, 6, time(0) / 30);
+		}
+		char codestr[16];
+		snprintf(codestr, sizeof(codestr), "%06u", code);
+		body = "follow_page=%2F&username=" + o.user + "&password=" + o.pass + "&totp=" + codestr;
+	}
+
+	std::string params;
+	param(&params, "REQUEST_METHOD", kind == 2 ? "POST" : "GET");
+	param(&params, "DOCUMENT_URI", kind == 0 ? "/auth" : "/login");
+	param(&params, "QUERY_STRING", kind == 1 ? "follow_page=https%3A%2F%2Fsomeweb.example.com%2F" : "");
+	param(&params, "HTTP_HOST", o.host);
+	param(&params, "REMOTE_ADDR", "127.0.0.1");
+	param(&params, "CONTENT_LENGTH", std::to_string(body.size()));
+	if (kind == 0)
+		param(&params, "HTTP_COOKIE", "theme=dark; authentication-token=" + o.cookie);
+
+	std::string ret;
+	std::string begin = { 0, FCGI_RESPONDER, (char)(o.keepconn ? FCGI_KEEP_CONN : 0), 0, 0, 0, 0, 0 };
+	record(&ret, FCGI_BEGIN_REQUEST, begin);
+	record(&ret, FCGI_PARAMS, params);
+	record(&ret, FCGI_PARAMS, "");
+	if (!body.empty())
+		record(&ret, FCGI_STDIN, body);
+	record(&ret, FCGI_STDIN, "");
+	return ret;
+}
+
+static bool readall(int fd, void *buf, size_t len) {
+	while (len) {
+		ssize_t r = read(fd, buf, len);
+		if (r <= 0)
+			return false;
+		buf = (char*)buf + r;
+		len -= r;
+	}
+	return true;
+}
+
+// Sends a request and reads records until END_REQUEST, returns the HTTP status
+static int roundtrip(int fd, const std::string &req) {
+	if (write(fd, req.data(), req.size()) != (ssize_t)req.size())
+		return -1;
+
+	int status = 0;
+	std::string out;
+	while (1) {
+		uint8_t hdr[8];
+		if (!readall(fd, hdr, sizeof(hdr)))
+			return -1;
+		size_t clen = (hdr[4] << 8) | hdr[5], plen = hdr[6];
+		std::string content(clen + plen, 0);
+		if (!readall(fd, &content[0], content.size()))
+			return -1;
+		if (hdr[1] == FCGI_STDOUT)
+			out.append(content, 0, clen);
+		else if (hdr[1] == FCGI_END_REQUEST)
+			break;
+	}
+	if (!strncmp(out.c_str(), "Status: ", 8))
+		status = atoi(&out[8]);
+	return status;
+}
+
+// Index in result_t::status
+static unsigned status_class(int st) {
+	if (st == 429)
+		return 3;
+	if (st >= 200 && st < 500)
+		return st / 100 - 2;
+	if (st >= 500 && st < 600)
+		return 4;
+	return 5;
+}
+
+static void client(const opts_t &o, unsigned id, std::atomic<bool> *stop, result_t *res) {
+	std::mt19937 rnd(id);
+	std::string reqs[3] = { build_request(o, 0), build_request(o, 1), build_request(o, 2) };
+	unsigned wsum = o.weights[0] + o.weights[1] + o.weights[2];
+	int fd = -1;
+
+	while (!*stop) {
+		unsigned w = rnd() % wsum;
+		unsigned kind = w < o.weights[0] ? 0 : w < o.weights[0] + o.weights[1] ? 1 : 2;
+
+		auto start = std::chrono::steady_clock::now();
+		if (fd < 0)
+			fd = dial(o.sock);
+		int st = fd < 0 ? -1 : roundtrip(fd, reqs[kind]);
+		auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - start).count();
+
+		if (st < 0) {
+			res->errors++;
+			if (fd >= 0)
+				close(fd);
+			fd = -1;
+			usleep(1000);
+			continue;
+		}
+		res->lat_us.push_back(us);
+		res->status[status_class(st)]++;
+
+		if (!o.keepconn) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	if (fd >= 0)
+		close(fd);
+}
+
+int main(int argc, char **argv) {
+	opts_t o;
+	std::string secret;
+	int c, uid = -1;
+	while ((c = getopt(argc, argv, "s:c:d:m:H:S:i:u:p:t:kl:")) != -1) {
+		switch (c) {
+		case 's': o.sock = optarg; break;
+		case 'c': o.clients = std::max(1, atoi(optarg)); break;
+		case 'd': o.duration = std::max(1, atoi(optarg)); break;
+		case 'm': sscanf(optarg, "%u,%u,%u", &o.weights[0], &o.weights[1], &o.weights[2]); break;
+		case 'H': o.host = optarg; break;
+		case 'S': secret = optarg; break;
+		case 'i': uid = atoi(optarg); break;
+		case 'u': o.user = optarg; break;
+		case 'p': o.pass = optarg; break;
+		case 't': o.totpseed = optarg; break;
+		case 'k': o.keepconn = true; break;
+		case 'l': o.label = optarg; break;
+		default:
+			std::cerr << "Usage: " << argv[0] << " -s socket [-c clients] [-d secs] [-m auth,get,post]"
+			          << " [-H host] [-S secret] [-i uid] [-u user] [-p pass] [-t totpseed] [-k] [-l label]" << std::endl;
+			return 1;
+		}
+	}
+	if (o.sock.empty() || !(o.weights[0] + o.weights[1] + o.weights[2])) {
+		std::cerr << "A socket (-s) and a non-zero request mix are required" << std::endl;
+		return 1;
+	}
+
+	// Mint a valid cookie, the same way the server does
+	cookie_keys_t ckeys(secret);
+	CookieCache nocache(0);
+	cred_t cred;
+	cred.uid = std::max(uid, 0);
+	o.cookie = CookieAuth(&ckeys, &nocache, uid >= 0).create(o.user, cred);
+
+	std::atomic<bool> stop(false);
+	std::vector<result_t> results(o.clients);
+	std::vector<std::thread> threads;
+	for (unsigned i = 0; i < o.clients; i++)
+		threads.emplace_back(client, std::cref(o), i, &stop, &results[i]);
+	sleep(o.duration);
+	stop = true;
+	for (auto & t : threads)
+		t.join();
+
+	result_t total;
+	for (const auto & r : results) {
+		total.lat_us.insert(total.lat_us.end(), r.lat_us.begin(), r.lat_us.end());
+		total.errors += r.errors;
+		for (unsigned i = 0; i < 6; i++)
+			total.status[i] += r.status[i];
+	}
+	std::sort(total.lat_us.begin(), total.lat_us.end());
+	auto pct = [&](double p) -> unsigned {
+		if (total.lat_us.empty())
+			return 0;
+		return total.lat_us[std::min(total.lat_us.size() - 1, (size_t)(p * total.lat_us.size()))];
+	};
+
+	printf("%s%sclients=%u requests=%zu errors=%lu rps=%.0f p50=%uus p99=%uus p999=%uus\n",
+	       o.label.c_str(), o.label.empty() ? "" : " ", o.clients, total.lat_us.size(),
+	       (unsigned long)total.errors, (double)total.lat_us.size() / o.duration,
+	       pct(0.5), pct(0.99), pct(0.999));
+	printf("  status 2xx=%lu 3xx=%lu 4xx=%lu 429=%lu 5xx=%lu other=%lu\n",
+	       (unsigned long)total.status[0], (unsigned long)total.status[1], (unsigned long)total.status[2],
+	       (unsigned long)total.status[3], (unsigned long)total.status[4], (unsigned long)total.status[5]);
+}
+
@@ -0,0 +1,266 @@
+
+// Microbenchmarks for the hot paths: TOTP computation, cookie checks,
+// request parsing, base32 decoding and rate limiting.
+// Usage: microbench.bin [filter]   (runs benchmarks whose name contains filter)
+//        microbench.bin -save baseline.txt
+//        microbench.bin -check baseline.txt [threshold%]
+// A baseline holds the time per op of every benchmark, checking against it
+// fails when any got slower than the threshold (20% by default).
+
+#include <iostream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <functional>
+#include <fstream>
+#include <cstring>
+#include <map>
+
+#include "../util.h"
+#include "../hmac.h"
+#include "../auth.h"
+#include "../cookiecache.h"
+#include "../ratelimit.h"
+#include "reference.h"
+
+#define BENCH_MIN_TIME_MS   300
+
+// Prevents the compiler from optimizing away the benchmarked expression
+template<typename T>
+static void keep(T &&v) {
+	asm volatile("" : : "g"(&v) : "memory");
+}
+
+struct bench_t {
+	std::string name;
+	std::function<void(uint64_t)> fn;   // Runs the body n times
+};
+
+static std::vector<bench_t> benchmarks;
+
+#define BENCH(name) \
+	static void bench_##name(uint64_t iters); \
+	static int reg_##name = (benchmarks.push_back({#name, bench_##name}), 0); \
+	static void bench_##name(uint64_t iters)
+
+// Runs the benchmark with growing iteration counts until it takes long enough
+static double run(const bench_t &b) {
+	uint64_t iters = 1;
+	while (1) {
+		auto start = std::chrono::steady_clock::now();
+		b.fn(iters);
+		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - start).count();
+		if (ns >= BENCH_MIN_TIME_MS * 1000000LL)
+			return (double)ns / iters;
+		// Aim a bit past the minimum (in floating point, an integer factor
+		// rounds down to 1 when close and never gets there)
+		iters = ns < 1000000 ? iters * 10 : iters * (BENCH_MIN_TIME_MS * 1100000.0 / ns) + 1;
+	}
+}
+
+static const std::string seed = b32dec(b32pad("JBSWY3DPEHPK3PXPJBSWY3DPEHPK3PXP"));
+
+BENCH(totp_calc_sha1) {
+	HmacKey key(EVP_sha1(), seed);
+	for (uint64_t i = 0; i < iters; i++)
+		keep(totp_calc(key, 6, i));
+}
+
+BENCH(totp_calc_sha512) {
+	HmacKey key(EVP_sha512(), seed);
+	for (uint64_t i = 0; i < iters; i++)
+		keep(totp_calc(key, 6, i));
+}
+
+BENCH(totp_valid_miss) {
+	cred_t c = { PasswordHash("pass"), HmacKey(EVP_sha1(), seed), 3600, 6, 30, hAlgoSha1 };
+	for (uint64_t i = 0; i < iters; i++)
+		keep(totp_valid(c, 1000000, 1));
+}
+
+BENCH(totp_valid_miss_cached) {
+	cred_t c = { PasswordHash("pass"), HmacKey(EVP_sha1(), seed), 3600, 6, 30, hAlgoSha1, 0,
+	             std::make_shared<totp_window_t>() };
+	for (uint64_t i = 0; i < iters; i++)
+		keep(totp_valid(c, 1000000, 1));
+}
+
+// Cookie check with and without the verified cookie cache (and revocation)
+static void bench_cookie(uint64_t iters, unsigned cachesize, bool compact, RevocationList *rev = nullptr) {
+	cookie_keys_t keys("some-random-string-that-is-relatively-long-used-for-cookie-minting");
+	CookieCache cache(cachesize);
+	CookieAuth ca(&keys, &cache, compact, rev);
+	users_t users;
+	users["user1"] = cred_t { PasswordHash("pass"), HmacKey(EVP_sha1(), seed), 3600, 6, 30, hAlgoSha1, 0,
+	                          nullptr, rev ? rev->user("someweb.example.com", "user1") : nullptr };
+	std::string cookie = ca.create("user1", *users.find("user1"));
+	for (uint64_t i = 0; i < iters; i++)
+		keep(ca.check(cookie, "someweb.example.com", users));
+}
+
+BENCH(check_cookie_uncached) {
+	bench_cookie(iters, 0, true);
+}
+
+BENCH(check_cookie_legacy_uncached) {
+	bench_cookie(iters, 0, false);
+}
+
+BENCH(check_cookie_cached) {
+	bench_cookie(iters, 1024, true);
+}
+
+BENCH(check_cookie_cached_revoked) {
+	// Some other tokens revoked, so the filter needs checking
+	unlink("/tmp/microbench.revoked");
+	RevocationList rev("/tmp/microbench.revoked", 64, 1 << 20);
+	for (unsigned i = 0; i < 1000; i++)
+		rev.revoke_token("token" + std::to_string(i));
+	bench_cookie(iters, 1024, true, &rev);
+	unlink("/tmp/microbench.revoked");
+}
+
+static const std::string postbody =
+	"follow_page=https%3A%2F%2Fsomeweb.example.com%2Fsome%2Fpath%3Fa%3Db&"
+	"username=user1&password=password123%21&totp=123456";
+static const std::string cookiejar =
+	"_ga=GA1.2.1234567890.1234567890; theme=dark; lang=en-US; "
+	"authentication-token=1700000000:7573657231:0123456789abcdef0123456789abcdef01234567; _gid=GA1.2.987654321";
+
+BENCH(parse_vars) {
+	for (uint64_t i = 0; i < iters; i++)
+		keep(parse_vars(postbody));
+}
+
+BENCH(find_var) {
+	for (uint64_t i = 0; i < iters; i++)
+		keep(find_var(postbody, "password"));
+}
+
+BENCH(parse_cookies) {
+	for (uint64_t i = 0; i < iters; i++)
+		keep(parse_cookies(cookiejar));
+}
+
+BENCH(find_cookie) {
+	for (uint64_t i = 0; i < iters; i++)
+		keep(find_cookie(cookiejar, "authentication-token"));
+}
+
+static const std::string hexmac = "0123456789abcdef0123456789ABCDEF0123456789abcdef0123456789abcdef";
+
+BENCH(hexdecode_scalar) {
+	uint8_t out[32];
+	for (uint64_t i = 0; i < iters; i++) {
+		hexdec_scalar(hexmac.data(), sizeof(out), out);
+		keep(out);
+	}
+}
+
+BENCH(hexdecode_kernel) {
+	uint8_t out[32];
+	for (uint64_t i = 0; i < iters; i++) {
+		hexdecode_raw(hexmac.data(), sizeof(out), out);
+		keep(out);
+	}
+}
+
+BENCH(hexencode_kernel) {
+	char out[64];
+	for (uint64_t i = 0; i < iters; i++) {
+		hexencode_raw((const uint8_t*)hexmac.data(), sizeof(out) / 2, out);
+		keep(out);
+	}
+}
+
+BENCH(urldec) {
+	std::string s = postbody;
+	for (uint64_t i = 0; i < iters; i++)
+		keep(urldec(s));
+}
+
+BENCH(urldecsv) {
+	for (uint64_t i = 0; i < iters; i++)
+		keep(urldecsv(postbody));
+}
+
+BENCH(b32dec) {
+	std::string s = "JBSWY3DPEHPK3PXPJBSWY3DPEHPK3PXP";
+	for (uint64_t i = 0; i < iters; i++)
+		keep(b32dec(s));
+}
+
+BENCH(ratelimit_same_ip) {
+	RateLimiter rl(1000000);
+	for (uint64_t i = 0; i < iters; i++)
+		keep(rl.allow(0x0a000001));
+}
+
+BENCH(ratelimit_unique_ips) {
+	RateLimiter rl(2);
+	for (uint64_t i = 0; i < iters; i++)
+		keep(rl.allow(i * 0x9e3779b97f4a7c15ULL));
+}
+
+// Best of a few runs, the closest to the real cost on a noisy machine
+static double best_of(const bench_t &b, unsigned n) {
+	double ret = run(b);
+	while (--n)
+		ret = std::min(ret, run(b));
+	return ret;
+}
+
+static int save(const char *fn) {
+	std::ofstream ofs(fn);
+	for (const auto & b : benchmarks) {
+		double ns = best_of(b, 3);
+		printf("%-28s %12.1f ns/op\n", b.name.c_str(), ns);
+		ofs << b.name << " " << ns << "\n";
+	}
+	return ofs.good() ? 0 : 1;
+}
+
+static int check(const char *fn, double threshold) {
+	std::map<std::string, double> baseline;
+	std::ifstream ifs(fn);
+	std::string name;
+	double ns;
+	while (ifs >> name >> ns)
+		baseline[name] = ns;
+	if (baseline.empty()) {
+		std::cerr << "Could not read baseline " << fn << std::endl;
+		return 1;
+	}
+
+	int ret = 0;
+	for (const auto & b : benchmarks) {
+		auto it = baseline.find(b.name);
+		if (it == baseline.end())
+			continue;
+		// Slower ones are retried, to rule out a hiccup
+		double cur = best_of(b, 3), limit = it->second * (1 + threshold / 100);
+		if (cur > limit)
+			cur = std::min(cur, best_of(b, 3));
+		bool slow = cur > limit;
+		printf("%-28s %12.1f ns/op %12.1f baseline %+7.1f%%%s\n", b.name.c_str(), cur, it->second,
+		       (cur / it->second - 1) * 100, slow ? "  REGRESSION" : "");
+		ret |= slow;
+	}
+	return ret;
+}
+
+int main(int argc, char **argv) {
+	if (argc > 2 && !strcmp(argv[1], "-save"))
+		return save(argv[2]);
+	if (argc > 2 && !strcmp(argv[1], "-check"))
+		return check(argv[2], argc > 3 ? atof(argv[3]) : 20);
+
+	const char *filter = argc > 1 ? argv[1] : "";
+	for (const auto & b : benchmarks) {
+		if (!strstr(b.name.c_str(), filter))
+			continue;
+		double ns = run(b);
+		printf("%-28s %12.1f ns/op %14.0f ops/s\n", b.name.c_str(), ns, 1e9 / ns);
+	}
+}
@@ -0,0 +1,79 @@
+
+#ifndef __REFERENCE__HH__
+#define __REFERENCE__HH__
+
+#include <string>
+#include <unordered_map>
+
+#include "../util.h"
+
+// The original, straightforward request parsers, which the server replaced
+// with the lookups in util.h. Only the benchmarks and fuzz targets use them,
+// as the baseline to compare against (both in speed and in results).
+
+static inline std::string hexdecode(std::string s) {
+	if (s.size() & 1)
+		return {};
+	std::string ret;
+	for (unsigned i = 0; i < s.size(); i += 2)
+		ret.push_back((char)((hexdec(s[i]) << 4) | hexdec(s[i+1])));
+	return ret;
+}
+
+static inline std::string trim(const std::string &s) {
+	auto ps = s.find_first_not_of(' ');
+	if (ps == std::string::npos)
+		return {};
+	auto pe = s.find_last_not_of(' ');
+	return s.substr(ps, pe + 1 - ps);
+}
+
+static inline std::string urldec(const std::string &s) {
+	std::string ret;
+	for (unsigned i = 0; i < s.size(); i++) {
+		if (s[i] == '%' && i + 2 < s.size()) {
+			ret += hexdecode(s.substr(i+1, 2));
+			i += 2;
+		}
+		else
+			ret.push_back(s[i]);
+	}
+	return ret;
+}
+
+static inline std::unordered_map<std::string, std::string> parse_cookies(std::string jar) {
+	std::unordered_map<std::string, std::string> cookies;
+	size_t p = 0;
+	while (1) {
+		size_t pe = jar.find(';', p);
+		std::string curc = pe != std::string::npos ? jar.substr(p, pe - p) : jar.substr(p);
+		size_t peq = curc.find('=');
+		if (peq != std::string::npos)
+			cookies[trim(curc.substr(0, peq))] = trim(curc.substr(peq+1));
+		if (pe == std::string::npos)
+			break;
+		p = pe + 1;
+	}
+
+	return cookies;
+}
+
+static inline std::unordered_map<std::string, std::string> parse_vars(std::string body) {
+	std::unordered_map<std::string, std::string> vars;
+	size_t p = 0;
+	while (1) {
+		size_t pe = body.find('&', p);
+		std::string curv = pe != std::string::npos ? body.substr(p, pe - p) : body.substr(p);
+		size_t peq = curv.find('=');
+		if (peq != std::string::npos)
+			vars[urldec(curv.substr(0, peq))] = urldec(curv.substr(peq+1));
+		if (pe == std::string::npos)
+			break;
+		p = pe + 1;
+	}
+
+	return vars;
+}
+
+#endif
+
@@ -0,0 +1,37 @@
+#!/usr/bin/env bash
+# Starts a local server for each of the given nthreads values and runs the
+# load generator against it, printing one result line per configuration.
+# Usage: bench/run.sh [nthreads...]   (default: 1 2 4 8)
+# Environment: DURATION (secs, default 10), CLIENTS (default 16), MIX (default 90,5,5)
+
+set -e
+cd "$(dirname "$0")"
+
+SOCK=/tmp/totp_bench.sock
+CONF=/tmp/totp_bench.conf
+SECRET=bench-secret-bench-secret-bench-secret
+SEED=JBSWY3DPEHPK3PXP
+
+for n in ${@:-1 2 4 8}; do
+	cat > $CONF <<CFG
+nthreads = $n;
+secret = "$SECRET";
+listen = "$SOCK";
+log-path = "/tmp/totp_bench";
+auth_per_second = 16000;
+webs = (
+  {
+    hostname = "someweb.example.com";
+    template = "gradient";
+    users = ( { username = "user1"; password = "pass"; totp = "$SEED"; duration = 3600; } );
+  }
+);
+CFG
+	../server.bin $CONF 2>/dev/null &
+	pid=$!
+	sleep 1
+	./loadgen.bin -s $SOCK -S $SECRET -p pass -t $SEED -d ${DURATION:-10} \
+	              -c ${CLIENTS:-16} -m ${MIX:-90,5,5} -l nthreads=$n
+	kill $pid
+	wait $pid || true
+done
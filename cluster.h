@@ -0,0 +1,316 @@
+
+#ifndef __CLUSTER__HH__
+#define __CLUSTER__HH__
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <memory>
+#include <cstring>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <openssl/crypto.h>
+
+#include "hmac.h"
+#include "ratelimit.h"
+#include "metrics.h"
+#include "shm.h"
+
+// Shares rate limiting across replicated instances. Logins accounted by
+// the local limiter are also counted in a small lock-free table (see
+// GossipTable), which a background thread drains every interval into UDP datagrams for every
+// peer (one entry per source with its hit count). Received hits are
+// charged to the local limiter, so a source gets about the same budget
+// across the whole cluster. Nothing on the request path touches the
+// network: if the table is full hits are just not shared.
+// Datagrams are authenticated with a key derived from the cookie secret
+// and carry a timestamp and a per node sequence number: stale ones, replays
+// (anything not newer than the last one from that node, so the odd
+// reordered one is lost too) and our own are ignored.
+
+#define GOSSIP_SLOTS         4096    // Power of two
+#define GOSSIP_PROBE         8
+#define GOSSIP_MAX_ENTRIES   96      // Per datagram (~1.2KB, fits any MTU)
+#define GOSSIP_MAGIC         0x54524c32
+#define GOSSIP_MAX_SKEW      10      // Seconds
+#define GOSSIP_MAX_NODES     64      // Peers tracked for replays
+#define GOSSIP_HDR_LEN       24
+#define GOSSIP_ENTRY_LEN     12
+#define GOSSIP_MAC_LEN       16
+
+// Hits not shared yet. It's kept apart from the gossip thread so that, with
+// an arena, worker processes can note hits while only the master gossips.
+class GossipTable {
+public:
+	GossipTable(ShmArena *arena = nullptr) {
+		if (arena)
+			slots = arena->alloc<slot_t>(GOSSIP_SLOTS);
+		else {
+			own_slots.reset(new slot_t[GOSSIP_SLOTS]);
+			slots = own_slots.get();
+		}
+	}
+
+	bool valid() const { return slots != nullptr; }
+
+	static size_t arena_size() {
+		return ShmArena::need<slot_t>(GOSSIP_SLOTS);
+	}
+
+	// Accounts a (locally allowed) hit for a source, never blocks
+	void note(uint64_t ip64) {
+		uint64_t k = ip64 + 1;    // Zero marks free slots
+		unsigned pos = (k * 0x9e3779b97f4a7c15ULL) >> 52;
+		for (unsigned i = 0; i < GOSSIP_PROBE; i++) {
+			slot_t *s = &slots[(pos + i) & (GOSSIP_SLOTS - 1)];
+			uint64_t sk = s->key.load(std::memory_order_relaxed);
+			if (!sk && s->key.compare_exchange_strong(sk, k, std::memory_order_relaxed))
+				sk = k;
+			if (sk == k) {
+				s->hits.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+		}
+	}
+
+	// Calls fn(source, hits) for every source with hits since the last
+	// time. A slot is freed once it had nothing to report for a whole
+	// interval; a hit racing with that might be carried over to another
+	// source, which is fine here.
+	template<typename F>
+	void drain(F fn) {
+		for (unsigned i = 0; i < GOSSIP_SLOTS; i++) {
+			uint64_t k = slots[i].key.load(std::memory_order_relaxed);
+			if (!k)
+				continue;
+			uint32_t hits = slots[i].hits.exchange(0, std::memory_order_relaxed);
+			if (!hits)
+				slots[i].key.store(0, std::memory_order_relaxed);
+			else
+				fn(k - 1, hits);
+		}
+	}
+
+private:
+	struct slot_t {
+		std::atomic<uint64_t> key{0};    // Source plus one
+		std::atomic<uint32_t> hits{0};
+	};
+
+	std::unique_ptr<slot_t[]> own_slots;
+	slot_t *slots = nullptr;
+};
+
+class ClusterGossip {
+public:
+	// Gossips the hits noted in the table, once started
+	ClusterGossip(GossipTable *table, RateLimiter *rl, std::string_view secret, const std::string &listen,
+	              const std::vector<std::string> &peers, unsigned interval_ms, Metrics *metrics)
+	 : table(table), rl(rl), key(EVP_sha256(), HmacKey(EVP_sha256(), secret).sign("totp-auth cluster gossip")),
+	   interval_ms(std::max(interval_ms, 10U)), metrics(metrics) {
+		node = std::random_device()();
+
+		struct addrinfo *res;
+		if (resolve(listen, true, &res))
+			return;
+		sock = socket(res->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if (sock >= 0 && bind(sock, res->ai_addr, res->ai_addrlen)) {
+			close(sock);
+			sock = -1;
+		}
+		freeaddrinfo(res);
+
+		for (const auto & p : peers) {
+			if (resolve(p, false, &res)) {
+				close(sock);
+				sock = -1;
+				return;
+			}
+			peer_t peer;
+			memcpy(&peer.addr, res->ai_addr, res->ai_addrlen);
+			peer.len = res->ai_addrlen;
+			this->peers.push_back(peer);
+			freeaddrinfo(res);
+		}
+	}
+
+	~ClusterGossip() {
+		end = true;
+		if (thread.joinable())
+			thread.join();
+		if (sock >= 0)
+			close(sock);
+	}
+
+	bool valid() const { return sock >= 0 && table->valid(); }
+
+	// Starts the thread, separately from the setup so that pre-fork mode
+	// can check the setup first and only run it in the master
+	void start() {
+		thread = std::thread(&ClusterGossip::run, this);
+	}
+
+private:
+	struct peer_t {
+		struct sockaddr_storage addr;
+		socklen_t len;
+	};
+
+	static int resolve(const std::string &addr, bool passive, struct addrinfo **res) {
+		auto p = addr.rfind(':');
+		if (p == std::string::npos)
+			return -1;
+		std::string host = addr.substr(0, p), port = addr.substr(p + 1);
+		struct addrinfo hints = {};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_DGRAM;
+		hints.ai_flags = passive ? AI_PASSIVE : 0;
+		return getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, res);
+	}
+
+	static void put_be(uint8_t *p, uint64_t v, unsigned len) {
+		for (unsigned i = 0; i < len; i++)
+			p[i] = v >> (8 * (len - 1 - i));
+	}
+
+	static uint64_t get_be(const uint8_t *p, unsigned len) {
+		uint64_t ret = 0;
+		for (unsigned i = 0; i < len; i++)
+			ret = (ret << 8) | p[i];
+		return ret;
+	}
+
+	void run() {
+		uint64_t next = mono_ns() + interval_ms * 1000000ULL;
+		while (!end) {
+			uint64_t now = mono_ns();
+			if (now >= next) {
+				flush();
+				next = now + interval_ms * 1000000ULL;
+				continue;
+			}
+			struct pollfd pfd = { sock, POLLIN, 0 };
+			if (poll(&pfd, 1, (next - now) / 1000000 + 1) > 0)
+				receive();
+		}
+	}
+
+	// Drains the hit counts and sends them to every peer
+	void flush() {
+		uint8_t pkt[GOSSIP_HDR_LEN + GOSSIP_MAX_ENTRIES * GOSSIP_ENTRY_LEN + EVP_MAX_MD_SIZE];
+		unsigned n = 0;
+		table->drain([&](uint64_t source, uint32_t hits) {
+			uint8_t *e = &pkt[GOSSIP_HDR_LEN + n * GOSSIP_ENTRY_LEN];
+			put_be(e, source, 8);
+			put_be(e + 8, hits, 4);
+			if (++n == GOSSIP_MAX_ENTRIES) {
+				send(pkt, n);
+				n = 0;
+			}
+		});
+		if (n)
+			send(pkt, n);
+	}
+
+	// Header: magic | node | time | entries | sequence (8)
+	void send(uint8_t *pkt, unsigned n) {
+		put_be(pkt, GOSSIP_MAGIC, 4);
+		put_be(pkt + 4, node, 4);
+		put_be(pkt + 8, time(0), 4);
+		put_be(pkt + 12, n, 4);
+		put_be(pkt + 16, ++seq, 8);
+		size_t len = GOSSIP_HDR_LEN + n * GOSSIP_ENTRY_LEN;
+		uint8_t mac[EVP_MAX_MD_SIZE];
+		key.sign(pkt, len, mac);
+		memcpy(&pkt[len], mac, GOSSIP_MAC_LEN);
+		for (const auto & p : peers)
+			sendto(sock, pkt, len + GOSSIP_MAC_LEN, MSG_DONTWAIT, (const struct sockaddr*)&p.addr, p.len);
+		if (metrics)
+			metrics->inc(ctClusterSent, n);
+	}
+
+	void receive() {
+		uint8_t pkt[2048], mac[EVP_MAX_MD_SIZE];
+		while (1) {
+			ssize_t r = recv(sock, pkt, sizeof(pkt), MSG_DONTWAIT);
+			if (r < 0)
+				return;
+			if (r < GOSSIP_HDR_LEN + GOSSIP_MAC_LEN || get_be(pkt, 4) != GOSSIP_MAGIC)
+				continue;
+			size_t n = get_be(pkt + 12, 4), len = GOSSIP_HDR_LEN + n * GOSSIP_ENTRY_LEN;
+			if (n > GOSSIP_MAX_ENTRIES || (size_t)r != len + GOSSIP_MAC_LEN)
+				continue;
+			key.sign(pkt, len, mac);
+			int64_t skew = (int64_t)get_be(pkt + 8, 4) - (int64_t)(uint32_t)time(0);
+			if (CRYPTO_memcmp(mac, &pkt[len], GOSSIP_MAC_LEN) || std::abs(skew) > GOSSIP_MAX_SKEW) {
+				if (metrics)
+					metrics->inc(ctClusterRejected);
+				continue;
+			}
+			uint32_t from = get_be(pkt + 4, 4);
+			if (from == node)
+				continue;    // Our own, when listed as a peer
+			if (replayed(from, get_be(pkt + 16, 8))) {
+				if (metrics)
+					metrics->inc(ctClusterRejected);
+				continue;
+			}
+
+			for (size_t i = 0; i < n; i++) {
+				const uint8_t *e = &pkt[GOSSIP_HDR_LEN + i * GOSSIP_ENTRY_LEN];
+				rl->charge(get_be(e, 8), get_be(e + 8, 4));
+			}
+			if (metrics)
+				metrics->inc(ctClusterReceived, n);
+		}
+	}
+
+	struct seen_t {
+		uint32_t node;
+		uint64_t seq;
+		time_t last;        // 0 for unused
+	};
+
+	// Records the sequence number seen from a node, true if it's not newer
+	// than the last one. Nodes not heard from for twice the allowed skew can
+	// be forgotten, their datagrams are past the timestamp check by then.
+	bool replayed(uint32_t from, uint64_t s) {
+		time_t now = time(0);
+		seen_t *slot = nullptr;
+		for (auto & n : seen) {
+			if (n.last && n.node == from) {
+				slot = &n;
+				break;
+			}
+			if (!slot && now - n.last > 2 * GOSSIP_MAX_SKEW)
+				slot = &n;
+		}
+		if (!slot)
+			return true;    // Too many live peers, can't tell
+		if (slot->last && slot->node == from && s <= slot->seq)
+			return true;
+		*slot = seen_t{ from, s, now };
+		return false;
+	}
+
+	GossipTable *table;
+	RateLimiter *rl;
+	HmacKey key;
+	unsigned interval_ms;
+	Metrics *metrics;
+	uint32_t node;
+	uint64_t seq = 0;
+	seen_t seen[GOSSIP_MAX_NODES] = {};
+	int sock = -1;
+	std::vector<peer_t> peers;
+	std::thread thread;
+	std::atomic<bool> end{false};
+};
+
+#endif
+
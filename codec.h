@@ -0,0 +1,145 @@
+
+#ifndef __CODEC__HH__
+#define __CODEC__HH__
+
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CODEC_X86
+#endif
+
+// Hex decoding/encoding kernels writing into caller provided
+// buffers. On x86 the bulk of the input is processed 16 or 32 characters
+// at a time (SSSE3/AVX2, picked at runtime), the rest byte by byte.
+// They behave exactly like the scalar versions in util.h (which they
+// replace on the hot paths), including mapping invalid hex digits to 0.
+
+// Nibble value of every char (0 for non hex chars)
+struct hexnibbles_t {
+	uint8_t v[256];
+	constexpr hexnibbles_t() : v() {
+		for (unsigned c = '0'; c <= '9'; c++)
+			v[c] = c - '0';
+		for (unsigned c = 'a'; c <= 'f'; c++)
+			v[c] = v[c - 32] = c - 'a' + 10;
+	}
+};
+static constexpr hexnibbles_t hexnibbles;
+
+static inline void hexdec_scalar(const char *in, size_t nbytes, uint8_t *out) {
+	for (size_t i = 0; i < nbytes; i++)
+		out[i] = (hexnibbles.v[(uint8_t)in[2*i]] << 4) | hexnibbles.v[(uint8_t)in[2*i+1]];
+}
+
+static inline void hexenc_scalar(const uint8_t *in, size_t nbytes, char *out) {
+	static const char hexdigits[] = "0123456789abcdef";
+	for (size_t i = 0; i < nbytes; i++) {
+		out[2*i]   = hexdigits[in[i] >> 4];
+		out[2*i+1] = hexdigits[in[i] & 15];
+	}
+}
+
+#ifdef CODEC_X86
+
+// Turns 16 hex chars into nibble values (0 for invalid chars)
+__attribute__((target("ssse3")))
+static inline __m128i hexnib_ssse3(__m128i v) {
+	__m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+	__m128i isdig = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+	                              _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+	__m128i isalp = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+	                              _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+	__m128i dval = _mm_and_si128(isdig, _mm_sub_epi8(v, _mm_set1_epi8('0')));
+	__m128i aval = _mm_and_si128(isalp, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10)));
+	return _mm_or_si128(dval, aval);
+}
+
+__attribute__((target("ssse3")))
+static inline void hexdec_ssse3(const char *in, size_t nbytes, uint8_t *out) {
+	size_t i = 0;
+	for (; i + 8 <= nbytes; i += 8) {
+		__m128i nib = hexnib_ssse3(_mm_loadu_si128((const __m128i*)&in[2*i]));
+		// Pairs of nibbles into bytes (hi * 16 + lo) and pack them
+		__m128i w = _mm_maddubs_epi16(nib, _mm_set1_epi16(0x0110));
+		_mm_storel_epi64((__m128i*)&out[i], _mm_packus_epi16(w, w));
+	}
+	hexdec_scalar(&in[2*i], nbytes - i, &out[i]);
+}
+
+__attribute__((target("avx2")))
+static inline void hexdec_avx2(const char *in, size_t nbytes, uint8_t *out) {
+	size_t i = 0;
+	for (; i + 16 <= nbytes; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)&in[2*i]);
+		__m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+		__m256i isdig = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+		                                 _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+		__m256i isalp = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+		                                 _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), lower));
+		__m256i nib = _mm256_or_si256(
+			_mm256_and_si256(isdig, _mm256_sub_epi8(v, _mm256_set1_epi8('0'))),
+			_mm256_and_si256(isalp, _mm256_sub_epi8(lower, _mm256_set1_epi8('a' - 10))));
+		__m256i w = _mm256_maddubs_epi16(nib, _mm256_set1_epi16(0x0110));
+		// Packing works per 128 bit lane, gather the two useful halves
+		__m256i p = _mm256_permute4x64_epi64(_mm256_packus_epi16(w, w), 0x08);
+		_mm_storeu_si128((__m128i*)&out[i], _mm256_castsi256_si128(p));
+	}
+	hexdec_ssse3(&in[2*i], nbytes - i, &out[i]);
+}
+
+__attribute__((target("ssse3")))
+static inline void hexenc_ssse3(const uint8_t *in, size_t nbytes, char *out) {
+	const __m128i digits = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+	                                     '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+	const __m128i lomask = _mm_set1_epi8(15);
+	size_t i = 0;
+	for (; i + 16 <= nbytes; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)&in[i]);
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), lomask);
+		__m128i lo = _mm_and_si128(v, lomask);
+		_mm_storeu_si128((__m128i*)&out[2*i], _mm_shuffle_epi8(digits, _mm_unpacklo_epi8(hi, lo)));
+		_mm_storeu_si128((__m128i*)&out[2*i+16], _mm_shuffle_epi8(digits, _mm_unpackhi_epi8(hi, lo)));
+	}
+	hexenc_scalar(&in[i], nbytes - i, &out[2*i]);
+}
+
+typedef void (*hexdec_fn)(const char*, size_t, uint8_t*);
+typedef void (*hexenc_fn)(const uint8_t*, size_t, char*);
+
+static inline hexdec_fn pick_hexdec() {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return hexdec_avx2;
+	if (__builtin_cpu_supports("ssse3"))
+		return hexdec_ssse3;
+	return hexdec_scalar;
+}
+
+static inline hexenc_fn pick_hexenc() {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("ssse3") ? hexenc_ssse3 : hexenc_scalar;
+}
+
+static const hexdec_fn hexdec_kernel = pick_hexdec();
+static const hexenc_fn hexenc_kernel = pick_hexenc();
+
+#else
+
+static const auto hexdec_kernel = hexdec_scalar;
+static const auto hexenc_kernel = hexenc_scalar;
+
+#endif
+
+// Decodes 2*nbytes hex chars
+static inline void hexdecode_raw(const char *in, size_t nbytes, uint8_t *out) {
+	hexdec_kernel(in, nbytes, out);
+}
+
+// Encodes nbytes into 2*nbytes hex chars
+static inline void hexencode_raw(const uint8_t *in, size_t nbytes, char *out) {
+	hexenc_kernel(in, nbytes, out);
+}
+
+#endif
+
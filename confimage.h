@@ -0,0 +1,229 @@
+
+#ifndef __CONFIMAGE__HH__
+#define __CONFIMAGE__HH__
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
+
+// Precompiled webs config: a versioned binary image with the webs and users
+// already validated and decoded (binary TOTP keys, no base32), so loading it
+// means mapping the file and walking flat tables instead of parsing the
+// config. Layout (host byte order, it's meant for the hosts compiling it):
+//   header | webs[nwebs] | users[nusers] | string pool
+// Webs own a contiguous range of users, in config order. Strings are
+// (offset, length) pairs into the pool. The header carries a truncated
+// SHA-256 of everything after it, so corrupt or truncated files are refused.
+
+#define IMG_MAGIC       0x474d494650544f54ULL   // "TOTPFIMG"
+#define IMG_VERSION     1
+#define IMG_SUM_LEN     16
+
+struct img_str_t {
+	uint32_t off, len;
+};
+
+struct img_hdr_t {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t nwebs;
+	uint32_t nusers;
+	uint32_t pool;            // String pool size
+	uint8_t sum[IMG_SUM_LEN];
+};
+
+struct img_web_t {
+	img_str_t hostname;
+	img_str_t webtemplate;
+	uint32_t totp_generations;
+	uint32_t first_user;
+	uint32_t nusers;
+	uint32_t pad;
+};
+
+struct img_user_t {
+	img_str_t username;
+	img_str_t password;       // As configured (plain text or hash spec)
+	img_str_t totp;           // HMAC key (the decoded seed, hashed if too long)
+	uint32_t sduration;
+	uint32_t period;
+	uint8_t digits;
+	uint8_t algorithm;
+	uint16_t pad;
+};
+
+// Checksum of an image (the header isn't covered)
+static inline void img_checksum(const char *img, size_t len, uint8_t *out) {
+	uint8_t h[EVP_MAX_MD_SIZE];
+	unsigned hlen = 0;
+	EVP_Digest(img + sizeof(img_hdr_t), len - sizeof(img_hdr_t), h, &hlen, EVP_sha256(), NULL);
+	memcpy(out, h, IMG_SUM_LEN);
+}
+
+// Builds an image, webs and then their users are added in order
+class ImageWriter {
+public:
+	void add_web(std::string_view hostname, std::string_view webtemplate, unsigned totp_generations) {
+		webs.push_back(img_web_t{ str(hostname), str(webtemplate), totp_generations,
+		                          (uint32_t)users.size(), 0, 0 });
+	}
+
+	// The key is the binary seed, md its TOTP algorithm
+	void add_user(std::string_view username, std::string_view password, std::string_view seed,
+	              const EVP_MD *md, unsigned algorithm, unsigned sduration, unsigned digits, unsigned period) {
+		// Keys longer than a block are hashed by HMAC anyway, do it now
+		uint8_t kbuf[EVP_MAX_MD_SIZE];
+		unsigned klen = 0;
+		if (seed.size() > (size_t)EVP_MD_block_size(md) &&
+		    EVP_Digest(seed.data(), seed.size(), kbuf, &klen, md, NULL))
+			seed = std::string_view((char*)kbuf, klen);
+
+		users.push_back(img_user_t{ str(username), str(password), str(seed), sduration, period,
+		                            (uint8_t)digits, (uint8_t)algorithm, 0 });
+		webs.back().nusers++;
+	}
+
+	std::string finish() const {
+		img_hdr_t hdr = {};
+		hdr.magic = IMG_MAGIC;
+		hdr.version = IMG_VERSION;
+		hdr.nwebs = webs.size();
+		hdr.nusers = users.size();
+		hdr.pool = pool.size();
+
+		std::string ret((char*)&hdr, sizeof(hdr));
+		ret.append((char*)webs.data(), webs.size() * sizeof(img_web_t));
+		ret.append((char*)users.data(), users.size() * sizeof(img_user_t));
+		ret += pool;
+		img_checksum(ret.data(), ret.size(), ((img_hdr_t*)&ret[0])->sum);
+		return ret;
+	}
+
+private:
+	img_str_t str(std::string_view s) {
+		img_str_t ret = { (uint32_t)pool.size(), (uint32_t)s.size() };
+		pool.append(s.data(), s.size());
+		return ret;
+	}
+
+	std::vector<img_web_t> webs;
+	std::vector<img_user_t> users;
+	std::string pool;
+};
+
+// Read only view of an image, either mapped from a file or in memory. All
+// the offsets are checked when opening, accessors don't check anything.
+class ConfigImage {
+public:
+	// Maps the file
+	ConfigImage(const char *path) {
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return;
+		struct stat st;
+		if (!fstat(fd, &st) && st.st_size >= (off_t)sizeof(img_hdr_t)) {
+			void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (p != MAP_FAILED) {
+				mapped = p;
+				setup((const char*)p, st.st_size);
+			}
+		}
+		close(fd);
+	}
+
+	// Uses the buffer (which must outlive the image)
+	ConfigImage(std::string_view buf) {
+		setup(buf.data(), buf.size());
+	}
+
+	~ConfigImage() {
+		if (mapped)
+			munmap(mapped, size);
+	}
+
+	ConfigImage(const ConfigImage&) = delete;
+	ConfigImage& operator=(const ConfigImage&) = delete;
+
+	bool valid() const { return hdr != nullptr; }
+
+	unsigned nwebs() const { return hdr->nwebs; }
+	const img_web_t &web(unsigned i) const { return webs[i]; }
+	const img_user_t &user(unsigned i) const { return users[i]; }
+
+	std::string_view str(const img_str_t &s) const {
+		return std::string_view(pool + s.off, s.len);
+	}
+
+	// Writes an image to path, replacing it atomically (servers mapping the
+	// old one keep their copy)
+	static bool write(const std::string &img, const std::string &path) {
+		std::string tmp = path + ".tmp";
+		int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if (fd < 0)
+			return false;
+		bool ok = ::write(fd, img.data(), img.size()) == (ssize_t)img.size() && !fsync(fd);
+		ok = !close(fd) && ok && !rename(tmp.c_str(), path.c_str());
+		if (!ok)
+			unlink(tmp.c_str());
+		return ok;
+	}
+
+private:
+	bool in_pool(const img_str_t &s) const {
+		return (uint64_t)s.off + s.len <= hdr->pool;
+	}
+
+	void setup(const char *buf, size_t len) {
+		size = len;
+		if (len < sizeof(img_hdr_t))
+			return;
+		const img_hdr_t *h = (const img_hdr_t*)buf;
+		uint64_t need = sizeof(img_hdr_t) + (uint64_t)h->nwebs * sizeof(img_web_t) +
+		                (uint64_t)h->nusers * sizeof(img_user_t) + h->pool;
+		if (h->magic != IMG_MAGIC || h->version != IMG_VERSION || need != len)
+			return;
+
+		uint8_t sum[IMG_SUM_LEN];
+		img_checksum(buf, len, sum);
+		if (CRYPTO_memcmp(sum, h->sum, IMG_SUM_LEN))
+			return;
+
+		hdr = h;
+		webs = (const img_web_t*)(buf + sizeof(img_hdr_t));
+		users = (const img_user_t*)(webs + h->nwebs);
+		pool = (const char*)(users + h->nusers);
+
+		for (unsigned i = 0; i < h->nwebs; i++) {
+			const img_web_t &w = webs[i];
+			if (!in_pool(w.hostname) || !in_pool(w.webtemplate) ||
+			    (uint64_t)w.first_user + w.nusers > h->nusers) {
+				hdr = nullptr;
+				return;
+			}
+		}
+		for (unsigned i = 0; i < h->nusers; i++) {
+			const img_user_t &u = users[i];
+			if (!in_pool(u.username) || !in_pool(u.password) || !in_pool(u.totp)) {
+				hdr = nullptr;
+				return;
+			}
+		}
+	}
+
+	void *mapped = nullptr;
+	size_t size = 0;
+	const img_hdr_t *hdr = nullptr;
+	const img_web_t *webs = nullptr;
+	const img_user_t *users = nullptr;
+	const char *pool = nullptr;
+};
+
+#endif
+
@@ -0,0 +1,231 @@
+
+#ifndef __COOKIECACHE__HH__
+#define __COOKIECACHE__HH__
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <cstring>
+#include <ctime>
+#include <cerrno>
+#include <pthread.h>
+
+#include "util.h"
+#include "shm.h"
+
+// Cache of recently verified authentication tokens. Every page load triggers
+// dozens of /auth subrequests with the very same cookie, so we remember the
+// tokens that passed validation (and until when they are valid) to skip the
+// parsing and HMAC work for them.
+// Entries are grouped in small sets (evicted in LRU order) which are spread
+// across a few independently locked shards. The entries and locks can be
+// placed in a shared memory arena, to share the cache among processes.
+
+#define CC_TOKEN_MAX    118   // Longer tokens are simply not cached
+#define CC_WAYS           8   // Entries per set
+#define CC_SHARDS        16   // Number of locks
+
+class CookieCache {
+private:
+	struct entry_t {
+		uint64_t hash;                 // Token hash
+		uint64_t hhash;                // Hostname hash
+		int64_t  expiry;               // Timestamp after which the token is no longer valid
+		uint32_t epoch;                // Cache epoch at insertion time
+		uint32_t gen;                  // Config generation the token was verified against
+		uint32_t tick;                 // Last use (for LRU eviction)
+		uint16_t toklen;               // Token length (0 means unused entry)
+		char     token[CC_TOKEN_MAX];  // Actual token (to rule out hash collisions)
+	};
+
+	// Spinlocks, unless the cache is in shared memory: a process may die
+	// holding a lock there, which must not block the rest, so those are
+	// robust process shared mutexes (a bit slower).
+	struct alignas(64) shard_t {
+		std::atomic<bool> locked{false};
+		bool shared = false;
+		uint32_t tick = 0;
+		pthread_mutex_t mu;
+
+		void share() {
+			pthread_mutexattr_t attr;
+			pthread_mutexattr_init(&attr);
+			pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+			pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+			pthread_mutex_init(&mu, &attr);
+			pthread_mutexattr_destroy(&attr);
+			shared = true;
+		}
+
+		// Returns 1 once taken, 0 if the previous owner died holding it (it's
+		// taken anyway, but whatever it was writing may be half done) and -1
+		// if it couldn't be taken (ie. left unrecoverable)
+		int lock() {
+			if (!shared) {
+				while (locked.exchange(true, std::memory_order_acquire))
+					while (locked.load(std::memory_order_relaxed))
+						cpu_relax();
+				return 1;
+			}
+			int err = pthread_mutex_lock(&mu);
+			if (!err)
+				return 1;
+			if (err != EOWNERDEAD)
+				return -1;
+			if (!pthread_mutex_consistent(&mu))
+				return 0;
+			pthread_mutex_unlock(&mu);
+			return -1;
+		}
+		void unlock() {
+			if (!shared)
+				locked.store(false, std::memory_order_release);
+			else
+				pthread_mutex_unlock(&mu);
+		}
+	};
+
+	struct state_t {
+		shard_t shards[CC_SHARDS];
+		std::atomic<uint32_t> epoch{1};   // Bumping it invalidates all entries
+	};
+
+	std::vector<entry_t> own_entries;
+	std::unique_ptr<state_t> own_state;
+	entry_t *entries;
+	shard_t *shards = nullptr;
+	std::atomic<uint32_t> *epoch = nullptr;
+	unsigned nsets;
+
+	static uint64_t hashsv(std::string_view s) {
+		return std::hash<std::string_view>{}(s);
+	}
+
+	// Locks a shard and gets the current epoch, false if the lock can't be
+	// taken (the shard is left alone then). Entries of a shard whose owner
+	// died might be half written, so they are all invalidated.
+	bool lock(shard_t *sh, uint32_t *cepoch) {
+		int st = sh->lock();
+		if (st < 0)
+			return false;
+		if (!st)
+			epoch->fetch_add(1, std::memory_order_relaxed);
+		*cepoch = epoch->load(std::memory_order_relaxed);
+		return true;
+	}
+
+public:
+	// Size is the (approximate) max number of tokens to hold, 0 disables the cache
+	CookieCache(unsigned size)
+	 : own_state(new state_t()), nsets((size + CC_WAYS - 1) / CC_WAYS) {
+		own_entries.resize(nsets * CC_WAYS);
+		if (nsets)   // No buffer otherwise
+			memset(own_entries.data(), 0, own_entries.size() * sizeof(entry_t));
+		entries = own_entries.data();
+		shards = own_state->shards;
+		epoch = &own_state->epoch;
+	}
+
+	// Same, with everything in the arena (which must have arena_size() room).
+	// Check valid() before using it.
+	CookieCache(unsigned size, ShmArena *arena)
+	 : nsets((size + CC_WAYS - 1) / CC_WAYS) {
+		state_t *st = arena->alloc<state_t>();
+		entries = arena->alloc<entry_t>(nsets * CC_WAYS);
+		if (!st || !entries) {
+			nsets = 0;
+			return;
+		}
+		for (unsigned i = 0; i < CC_SHARDS; i++)
+			st->shards[i].share();
+		shards = st->shards;
+		epoch = &st->epoch;
+	}
+
+	bool valid() const { return shards != nullptr; }
+
+	static size_t arena_size(unsigned size) {
+		return ShmArena::need<state_t>() + ShmArena::need<entry_t>((size + CC_WAYS - 1) / CC_WAYS * CC_WAYS);
+	}
+
+	// Returns true if the token was verified for this host and is still valid.
+	// Entries are tagged with the config generation they were verified with,
+	// so tokens verified against an older (or newer) config don't match.
+	bool lookup(std::string_view token, std::string_view host, time_t now, uint32_t gen = 0) {
+		if (!nsets || token.empty() || token.size() > CC_TOKEN_MAX)
+			return false;
+
+		uint64_t h = hashsv(token), hh = hashsv(host);
+		unsigned setn = h % nsets;
+		shard_t *sh = &shards[setn % CC_SHARDS];
+		entry_t *set = &entries[setn * CC_WAYS];
+
+		bool ret = false;
+		uint32_t cepoch;
+		if (!lock(sh, &cepoch))
+			return false;
+		for (unsigned i = 0; i < CC_WAYS; i++) {
+			entry_t *e = &set[i];
+			if (e->hash == h && e->hhash == hh && e->epoch == cepoch && e->gen == gen &&
+			    e->toklen == token.size() && !memcmp(e->token, token.data(), token.size())) {
+				ret = (now <= e->expiry);
+				if (ret)
+					e->tick = ++sh->tick;
+				else
+					e->toklen = 0;   // Expired, free the entry
+				break;
+			}
+		}
+		sh->unlock();
+		return ret;
+	}
+
+	// Remembers a verified token (valid until expiry)
+	void insert(std::string_view token, std::string_view host, time_t expiry, uint32_t gen = 0) {
+		if (!nsets || token.empty() || token.size() > CC_TOKEN_MAX)
+			return;
+
+		uint64_t h = hashsv(token), hh = hashsv(host);
+		unsigned setn = h % nsets;
+		shard_t *sh = &shards[setn % CC_SHARDS];
+		entry_t *set = &entries[setn * CC_WAYS];
+
+		uint32_t cepoch;
+		if (!lock(sh, &cepoch))
+			return;
+		// Reuse the token entry if present, or pick a free (or stale) one,
+		// otherwise evict the least recently used one.
+		entry_t *victim = &set[0];
+		for (unsigned i = 0; i < CC_WAYS; i++) {
+			entry_t *e = &set[i];
+			bool same = e->hash == h && e->hhash == hh && e->toklen == token.size() &&
+			            !memcmp(e->token, token.data(), token.size());
+			if (same || !e->toklen || e->epoch != cepoch) {
+				victim = e;
+				break;
+			}
+			if ((int32_t)(e->tick - victim->tick) < 0)
+				victim = e;
+		}
+		victim->hash = h;
+		victim->hhash = hh;
+		victim->expiry = expiry;
+		victim->epoch = cepoch;
+		victim->gen = gen;
+		victim->tick = ++sh->tick;
+		victim->toklen = token.size();
+		memcpy(victim->token, token.data(), token.size());
+		sh->unlock();
+	}
+
+	// Invalidates all the cached tokens (ie. on secret or config change)
+	void flush() {
+		if (epoch)
+			(*epoch)++;
+	}
+};
+
+#endif
+
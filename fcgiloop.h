@@ -0,0 +1,534 @@
+
+#ifndef __FCGILOOP__HH__
+#define __FCGILOOP__HH__
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "util.h"
+#include "response.h"
+
+// Event driven FastCGI front end. Every loop runs on its own thread with its
+// own epoll set, accepting from a shared (or its own) listen socket and
+// reading and writing non-blocking connections. Records are parsed here
+// (multiplexed requests and FCGI_KEEP_CONN are supported); once a request
+// is complete (params and stdin) it's handed over to a worker through the
+// dispatch callback, and the worker hands the response back with respond().
+// So slow or stalled connections never hold a worker, and those that make no
+// progress (idle, or stuck mid-request or mid-response) for longer than the
+// timeout are closed, so they don't hold on to their fd and buffers either.
+
+#define FCGI_HEADER_LEN        8
+#define FCGI_BEGIN_REQUEST     1
+#define FCGI_ABORT_REQUEST     2
+#define FCGI_END_REQUEST       3
+#define FCGI_PARAMS            4
+#define FCGI_STDIN             5
+#define FCGI_STDOUT            6
+#define FCGI_GET_VALUES        9
+#define FCGI_GET_VALUES_RESULT 10
+#define FCGI_UNKNOWN_TYPE      11
+#define FCGI_RESPONDER         1
+#define FCGI_KEEP_CONN         1
+#define FCGI_REQUEST_COMPLETE  0
+#define FCGI_UNKNOWN_ROLE      3
+
+#define LOOP_MAX_PARAMS   (64*1024)   // Bigger params close the connection
+#define LOOP_READ_CHUNK   (64*1024)
+#define LOOP_MAX_EVENTS   256
+#define LOOP_ACCEPT_PAUSE  100        // Ms without accepting when out of fds or memory
+
+class EventLoop;
+
+// A request read by an event loop
+struct AsyncRequest {
+	EventLoop *loop;
+	uint64_t connid;                // Connection it came from
+	uint16_t id;                    // FastCGI request id
+	bool keep_conn;
+	bool params_done = false;
+	std::string params;             // Raw name-value pairs
+	std::vector<std::string> env;   // As "NAME=VALUE" strings
+	std::vector<char*> envp;        // Null terminated, like FCGX_Request::envp
+	std::string body;               // Up to maxbody bytes
+	std::string out;                // Response records
+
+	// Frames the response and hands it back to the loop (which owns the
+	// request from there on), can be called from any thread.
+	inline void respond(const Response &resp);
+};
+
+static inline void fcgi_header(std::string *out, uint8_t type, uint16_t id, size_t len) {
+	uint8_t hdr[FCGI_HEADER_LEN] = { 1, type, (uint8_t)(id >> 8), (uint8_t)(id & 255),
+		(uint8_t)(len >> 8), (uint8_t)(len & 255), 0, 0 };
+	out->append((char*)hdr, sizeof(hdr));
+}
+
+static inline void fcgi_end_request(std::string *out, uint16_t id, uint8_t status) {
+	const char body[8] = { 0, 0, 0, 0, (char)status, 0, 0, 0 };
+	fcgi_header(out, FCGI_END_REQUEST, id, sizeof(body));
+	out->append(body, sizeof(body));
+}
+
+static inline void fcgi_pair(std::string *out, std::string_view name, std::string_view value) {
+	for (size_t l : {name.size(), value.size()}) {
+		if (l < 128)
+			out->push_back((char)l);
+		else {
+			out->push_back((char)(0x80 | (l >> 24)));
+			out->push_back((char)((l >> 16) & 255));
+			out->push_back((char)((l >> 8) & 255));
+			out->push_back((char)(l & 255));
+		}
+	}
+	out->append(name);
+	out->append(value);
+}
+
+// Decodes name-value pairs into env ("NAME=VALUE"), false if malformed
+static inline bool fcgi_parse_params(std::string_view p, std::vector<std::string> *env) {
+	auto getlen = [&p](size_t *l) -> bool {
+		if (p.empty())
+			return false;
+		if (!(p[0] & 0x80)) {
+			*l = (uint8_t)p[0];
+			p.remove_prefix(1);
+			return true;
+		}
+		if (p.size() < 4)
+			return false;
+		*l = ((size_t)(p[0] & 0x7f) << 24) | ((size_t)(uint8_t)p[1] << 16) |
+		     ((size_t)(uint8_t)p[2] << 8) | (uint8_t)p[3];
+		p.remove_prefix(4);
+		return true;
+	};
+	while (!p.empty()) {
+		size_t nl, vl;
+		if (!getlen(&nl) || !getlen(&vl) || nl + vl > p.size())
+			return false;
+		std::string e;
+		e.reserve(nl + vl + 1);
+		e.append(p.data(), nl);
+		e.push_back('=');
+		e.append(p.data() + nl, vl);
+		env->push_back(std::move(e));
+		p.remove_prefix(nl + vl);
+	}
+	return true;
+}
+
+class EventLoop {
+public:
+	// Called with every complete request, must not block. Ownership goes
+	// along with it, the request must end up in respond() eventually.
+	typedef std::function<void(AsyncRequest*)> dispatch_fn;
+
+	EventLoop(int lsock, size_t maxbody, unsigned timeout, dispatch_fn dispatch)
+	 : lsock(lsock), maxbody(maxbody), timeout(timeout), dispatch(dispatch) {
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		fcntl(lsock, F_SETFL, fcntl(lsock, F_GETFL) | O_NONBLOCK);
+
+		watch_listen();
+		struct epoll_event ev = {};
+		ev.events = EPOLLIN;
+		ev.data.u64 = idEvent;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, evfd, &ev);
+
+		thread = std::thread(&EventLoop::run, this);
+	}
+
+	// Pins the loop thread (see pin_thread)
+	void pin(const std::vector<int> &cpus, int idx = -1) {
+		pin_thread(thread.native_handle(), cpus, idx);
+	}
+
+	~EventLoop() {
+		end = true;
+		wake();
+		thread.join();
+		for (auto & c : conns)
+			close_conn(c.second, false);
+		for (AsyncRequest *r : completed)
+			delete r;
+		close(epfd);
+		close(evfd);
+	}
+
+	// Hands a responded request back to the loop (any thread)
+	void complete(AsyncRequest *req) {
+		bool was_empty;
+		{
+			std::lock_guard<std::mutex> guard(compmu);
+			was_empty = completed.empty();
+			completed.push_back(req);
+		}
+		if (was_empty)
+			wake();
+	}
+
+	// Number of open connections
+	unsigned connections() const {
+		return nconns.load(std::memory_order_relaxed);
+	}
+
+private:
+	enum { idListen = 0, idEvent = 1, idFirstConn = 2 };
+
+	struct conn_t {
+		int fd;
+		uint64_t id;
+		std::string rbuf, wbuf;
+		size_t roff = 0, woff = 0;
+		std::unordered_map<uint16_t, AsyncRequest*> reqs;   // Still being read
+		unsigned inflight = 0;      // Handed to workers
+		time_t active;              // Last read or write progress
+		bool closing = false;       // Close once everything is written
+		bool want_out = false;      // Registered for EPOLLOUT
+	};
+
+	void wake() {
+		uint64_t one = 1;
+		if (write(evfd, &one, sizeof(one)) < 0) {}
+	}
+
+	// Several loops can wait on the same socket, only wake one of them
+	void watch_listen() {
+		struct epoll_event ev = {};
+		ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+		ev.data.u64 = idListen;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, lsock, &ev);
+	}
+
+	void run() {
+		struct epoll_event evs[LOOP_MAX_EVENTS];
+		time_t lastexp = time(0);
+		while (!end) {
+			int n = epoll_wait(epfd, evs, LOOP_MAX_EVENTS, paused ? LOOP_ACCEPT_PAUSE : 1000);
+			if (paused && std::chrono::steady_clock::now() >= resume) {
+				paused = false;
+				watch_listen();
+			}
+			for (int i = 0; i < n && !end; i++) {
+				uint64_t id = evs[i].data.u64;
+				if (id == idListen)
+					accept_conns();
+				else if (id == idEvent)
+					drain_completed();
+				else {
+					auto it = conns.find(id);
+					if (it == conns.end())
+						continue;
+					conn_t *c = it->second;
+					if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+						if (!on_readable(c))
+							continue;    // Closed
+					if (evs[i].events & EPOLLOUT)
+						flush(c);
+				}
+			}
+
+			// Close the connections that made no progress for too long,
+			// unless a worker still owes them a response
+			time_t now = time(0);
+			if (now == lastexp)
+				continue;
+			lastexp = now;
+			std::vector<conn_t*> expired;
+			for (auto & c : conns)
+				if (!c.second->inflight && now - c.second->active >= (time_t)timeout)
+					expired.push_back(c.second);
+			for (conn_t *c : expired)
+				close_conn(c);
+		}
+	}
+
+	void accept_conns() {
+		while (1) {
+			int fd = accept4(lsock, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (fd < 0) {
+				// Out of fds or memory the pending connections stay queued
+				// and would wake us right away, so the socket is unwatched
+				// for a bit and then watched again. Only once it's shut
+				// down it goes for good.
+				if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+					paused = true;
+					resume = std::chrono::steady_clock::now() + std::chrono::milliseconds(LOOP_ACCEPT_PAUSE);
+					epoll_ctl(epfd, EPOLL_CTL_DEL, lsock, nullptr);
+				}
+				else if (errno == EBADF || errno == EINVAL || errno == ENOTSOCK)
+					epoll_ctl(epfd, EPOLL_CTL_DEL, lsock, nullptr);
+				return;
+			}
+			conn_t *c = new conn_t();
+			c->fd = fd;
+			c->id = nextid++;
+			c->active = time(0);
+			conns[c->id] = c;
+			nconns++;
+
+			struct epoll_event ev = {};
+			ev.events = EPOLLIN;
+			ev.data.u64 = c->id;
+			epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+		}
+	}
+
+	void close_conn(conn_t *c, bool erase = true) {
+		for (auto & r : c->reqs)
+			delete r.second;
+		close(c->fd);   // Also removes it from the epoll set
+		if (erase)
+			conns.erase(c->id);
+		nconns--;
+		delete c;
+	}
+
+	// Reads and processes whatever is there, returns false if the conn was closed
+	bool on_readable(conn_t *c) {
+		char buf[LOOP_READ_CHUNK];
+		while (1) {
+			ssize_t r = read(c->fd, buf, sizeof(buf));
+			if (r > 0) {
+				c->active = time(0);
+				c->rbuf.append(buf, r);
+				if (!parse(c)) {
+					close_conn(c);
+					return false;
+				}
+				if ((size_t)r < sizeof(buf))
+					break;
+			}
+			else if (r < 0 && (errno == EAGAIN || errno == EINTR))
+				break;
+			else {
+				// Peer is gone (or error), responses in flight are discarded
+				close_conn(c);
+				return false;
+			}
+		}
+		return flush(c);
+	}
+
+	// Processes all the complete records, false on protocol errors
+	bool parse(conn_t *c) {
+		while (c->rbuf.size() - c->roff >= FCGI_HEADER_LEN) {
+			const uint8_t *h = (const uint8_t*)&c->rbuf[c->roff];
+			uint8_t type = h[1];
+			uint16_t id = (h[2] << 8) | h[3];
+			size_t clen = (h[4] << 8) | h[5], plen = h[6];
+			if (c->rbuf.size() - c->roff < FCGI_HEADER_LEN + clen + plen)
+				break;
+			std::string_view content(&c->rbuf[c->roff + FCGI_HEADER_LEN], clen);
+			c->roff += FCGI_HEADER_LEN + clen + plen;
+			if (!record(c, type, id, content))
+				return false;
+		}
+		// Drop consumed data once in a while
+		if (c->roff && c->roff * 2 >= c->rbuf.size()) {
+			c->rbuf.erase(0, c->roff);
+			c->roff = 0;
+		}
+		return true;
+	}
+
+	bool record(conn_t *c, uint8_t type, uint16_t id, std::string_view content) {
+		if (!id) {
+			// Management records
+			if (type == FCGI_GET_VALUES) {
+				std::string vals;
+				fcgi_pair(&vals, "FCGI_MAX_CONNS", "10000");
+				fcgi_pair(&vals, "FCGI_MAX_REQS", "10000");
+				fcgi_pair(&vals, "FCGI_MPXS_CONNS", "1");
+				fcgi_header(&c->wbuf, FCGI_GET_VALUES_RESULT, 0, vals.size());
+				c->wbuf += vals;
+			}
+			else {
+				const char body[8] = { (char)type };
+				fcgi_header(&c->wbuf, FCGI_UNKNOWN_TYPE, 0, sizeof(body));
+				c->wbuf.append(body, sizeof(body));
+			}
+			return true;
+		}
+
+		if (type == FCGI_BEGIN_REQUEST) {
+			if (content.size() < 8)
+				return false;
+			unsigned role = ((uint8_t)content[0] << 8) | (uint8_t)content[1];
+			bool keep = content[2] & FCGI_KEEP_CONN;
+			if (!keep)
+				c->closing = true;
+			if (role != FCGI_RESPONDER) {
+				fcgi_end_request(&c->wbuf, id, FCGI_UNKNOWN_ROLE);
+				return true;
+			}
+			auto &slot = c->reqs[id];
+			delete slot;
+			slot = new AsyncRequest();
+			slot->loop = this;
+			slot->connid = c->id;
+			slot->id = id;
+			slot->keep_conn = keep;
+			return true;
+		}
+
+		auto it = c->reqs.find(id);
+		if (it == c->reqs.end())
+			return true;    // Not ours (or already dispatched), ignore it
+		AsyncRequest *req = it->second;
+
+		switch (type) {
+		case FCGI_ABORT_REQUEST:
+			c->reqs.erase(it);
+			delete req;
+			fcgi_end_request(&c->wbuf, id, FCGI_REQUEST_COMPLETE);
+			return true;
+		case FCGI_PARAMS:
+			if (content.empty()) {
+				req->params_done = true;
+				if (!fcgi_parse_params(req->params, &req->env))
+					return false;
+				req->params = std::string();
+				for (auto & e : req->env)
+					req->envp.push_back(&e[0]);
+				req->envp.push_back(nullptr);
+				return true;
+			}
+			if (req->params.size() + content.size() > LOOP_MAX_PARAMS)
+				return false;
+			req->params.append(content);
+			return true;
+		case FCGI_STDIN:
+			if (!content.empty()) {
+				req->body.append(content.substr(0, maxbody - std::min(maxbody, req->body.size())));
+				return true;
+			}
+			if (!req->params_done)
+				return false;
+			// Complete, off it goes
+			c->reqs.erase(it);
+			c->inflight++;
+			dispatch(req);
+			return true;
+		default:
+			return true;
+		}
+	}
+
+	void drain_completed() {
+		uint64_t cnt;
+		if (read(evfd, &cnt, sizeof(cnt)) < 0) {}
+		std::vector<AsyncRequest*> reqs;
+		{
+			std::lock_guard<std::mutex> guard(compmu);
+			reqs.swap(completed);
+		}
+
+		for (AsyncRequest *req : reqs) {
+			auto it = conns.find(req->connid);
+			if (it != conns.end()) {
+				conn_t *c = it->second;
+				c->wbuf += req->out;
+				c->inflight--;
+				pending_flush.push_back(c->id);
+			}
+			delete req;
+		}
+
+		// Flush every connection once
+		for (uint64_t id : pending_flush) {
+			auto it = conns.find(id);
+			if (it != conns.end())
+				flush(it->second);
+		}
+		pending_flush.clear();
+	}
+
+	// Writes what's pending, returns false if the connection got closed
+	bool flush(conn_t *c) {
+		while (c->woff < c->wbuf.size()) {
+			ssize_t w = write(c->fd, &c->wbuf[c->woff], c->wbuf.size() - c->woff);
+			if (w > 0) {
+				c->woff += w;
+				c->active = time(0);
+			}
+			else if (w < 0 && (errno == EAGAIN || errno == EINTR))
+				break;
+			else {
+				close_conn(c);
+				return false;
+			}
+		}
+		if (c->woff == c->wbuf.size()) {
+			c->wbuf.clear();
+			c->woff = 0;
+			if (c->closing && !c->inflight && c->reqs.empty()) {
+				close_conn(c);
+				return false;
+			}
+		}
+
+		// Only ask for EPOLLOUT while there's something left to write
+		bool want = !c->wbuf.empty();
+		if (want != c->want_out) {
+			struct epoll_event ev = {};
+			ev.events = EPOLLIN | (want ? EPOLLOUT : 0);
+			ev.data.u64 = c->id;
+			epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+			c->want_out = want;
+		}
+		return true;
+	}
+
+	int lsock, epfd, evfd;
+	bool paused = false;      // Not accepting until resume
+	std::chrono::steady_clock::time_point resume;
+	size_t maxbody;
+	unsigned timeout;         // Seconds without progress before closing a connection
+	dispatch_fn dispatch;
+	std::thread thread;
+	std::atomic<bool> end{false};
+
+	// Loop thread only
+	std::unordered_map<uint64_t, conn_t*> conns;
+	std::vector<uint64_t> pending_flush;
+	uint64_t nextid = idFirstConn;
+	std::atomic<unsigned> nconns{0};
+
+	// Responses handed back by workers
+	std::mutex compmu;
+	std::vector<AsyncRequest*> completed;
+};
+
+void AsyncRequest::respond(const Response &resp) {
+	// STDOUT records (max 64KiB each), the end of the stream and END_REQUEST
+	out.reserve(resp.size() + 4 * FCGI_HEADER_LEN + 8);
+	for (std::string_view part : resp) {
+		while (!part.empty()) {
+			size_t l = std::min(part.size(), (size_t)65535);
+			fcgi_header(&out, FCGI_STDOUT, id, l);
+			out.append(part.data(), l);
+			part.remove_prefix(l);
+		}
+	}
+	fcgi_header(&out, FCGI_STDOUT, id, 0);
+	fcgi_end_request(&out, id, FCGI_REQUEST_COMPLETE);
+	loop->complete(this);
+}
+
+#endif
+
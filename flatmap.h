@@ -0,0 +1,96 @@
+
+#ifndef __FLATMAP__HH__
+#define __FLATMAP__HH__
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <algorithm>
+
+// String keyed map that is built once (at config load) and then only read.
+// Values sit in a contiguous array and an open addressing index (at most
+// half full) holds their precomputed hashes, so a lookup hashes the key
+// once, probes a couple of adjacent slots and only compares strings on a
+// hash match. Lookups take a string_view (no std::string needed) and return
+// a pointer to the value, which stays valid as long as the map isn't changed.
+
+template<typename T>
+class FlatMap {
+public:
+	struct entry_t {
+		std::string key;
+		T value;
+	};
+
+	// Inserts a default value if the key is not there (only while building)
+	T& operator[](std::string_view key) {
+		uint64_t h = hash(key);
+		if (T *v = lookup(key, h))
+			return *v;
+
+		entries.push_back(entry_t{std::string(key), T()});
+		if (entries.size() * 2 > index.size())
+			rehash(std::max((size_t)16, index.size() * 2));
+		else
+			place(h, entries.size() - 1);
+		return entries.back().value;
+	}
+
+	const T *find(std::string_view key) const {
+		return const_cast<FlatMap*>(this)->lookup(key, hash(key));
+	}
+
+	// Entries are numbered in insertion order
+	const entry_t *at(size_t idx) const {
+		return idx < entries.size() ? &entries[idx] : nullptr;
+	}
+
+	size_t size() const { return entries.size(); }
+	size_t count(std::string_view key) const { return find(key) ? 1 : 0; }
+
+	typename std::vector<entry_t>::const_iterator begin() const { return entries.begin(); }
+	typename std::vector<entry_t>::const_iterator end() const { return entries.end(); }
+
+private:
+	struct slot_t {
+		uint64_t hash;
+		uint32_t idx;     // Entry index plus one (0 means empty)
+	};
+
+	static uint64_t hash(std::string_view key) {
+		return std::hash<std::string_view>{}(key);
+	}
+
+	T *lookup(std::string_view key, uint64_t h) {
+		if (index.empty())
+			return nullptr;
+		size_t mask = index.size() - 1;
+		for (size_t i = h & mask; index[i].idx; i = (i + 1) & mask) {
+			entry_t *e = &entries[index[i].idx - 1];
+			if (index[i].hash == h && e->key == key)
+				return &e->value;
+		}
+		return nullptr;
+	}
+
+	void place(uint64_t h, size_t idx) {
+		size_t mask = index.size() - 1;
+		size_t i = h & mask;
+		while (index[i].idx)
+			i = (i + 1) & mask;
+		index[i] = slot_t{h, (uint32_t)(idx + 1)};
+	}
+
+	void rehash(size_t slots) {
+		index.assign(slots, slot_t{0, 0});
+		for (size_t i = 0; i < entries.size(); i++)
+			place(hash(entries[i].key), i);
+	}
+
+	std::vector<entry_t> entries;
+	std::vector<slot_t> index;    // Power of two sized
+};
+
+#endif
+
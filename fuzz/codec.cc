@@ -0,0 +1,63 @@
+
+// Decoders: the vectorized hex kernels (codec.h) and the string_view url
+// decoder must produce the same output as the reference ones, and base32
+// decoding must undo a (reference) encoding and survive any input.
+// Input: first byte selects the check, the rest is the data.
+
+#include <cstdlib>
+
+#include "../util.h"
+#include "../bench/reference.h"
+
+// Plain RFC 4648 base32 encoder, unpadded
+static std::string b32enc(std::string_view s) {
+	static const char charset[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
+	std::string ret;
+	uint64_t ac = 0;
+	unsigned bits = 0;
+	for (unsigned char c : s) {
+		ac = (ac << 8) | c;
+		for (bits += 8; bits >= 5; bits -= 5)
+			ret.push_back(charset[(ac >> (bits - 5)) & 31]);
+	}
+	if (bits)
+		ret.push_back(charset[(ac << (5 - bits)) & 31]);
+	return ret;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	if (!size)
+		return 0;
+	std::string input((const char*)&data[1], size - 1);
+	switch (data[0] & 3) {
+	case 0:
+		if (urldecsv(input) != urldec(input))
+			abort();
+		break;
+	case 1: {
+		size_t n = input.size() / 2;
+		std::string fast(n, 0), ref(n, 0);
+		hexdecode_raw(input.data(), n, (uint8_t*)&fast[0]);
+		hexdec_scalar(input.data(), n, (uint8_t*)&ref[0]);
+		if (fast != ref || (!(input.size() & 1) && hexdecode(input) != ref))
+			abort();
+		break;
+	}
+	case 2: {
+		std::string fast(input.size() * 2, 0), ref(input.size() * 2, 0);
+		hexencode_raw((const uint8_t*)input.data(), input.size(), &fast[0]);
+		hexenc_scalar((const uint8_t*)input.data(), input.size(), &ref[0]);
+		if (fast != ref)
+			abort();
+		break;
+	}
+	case 3:
+		// Lowercase is accepted too (seeds are often written that way)
+		if (b32dec(b32pad(b32enc(input))) != input)
+			abort();
+		b32dec(input);
+		b32dec(b32pad(input));
+		break;
+	}
+	return 0;
+}
@@ -0,0 +1,67 @@
+
+// Cookie checks: the outcome must not depend on the verified cookie cache,
+// cookies issued by create() must be valid and any change to them must be
+// refused (there's a single valid encoding).
+// Input: first byte picks how the cookie is made. With the low bit clear
+// the rest is the cookie itself, otherwise the rest is patched over a
+// freshly issued one (compact or legacy, depending on the next bit).
+
+#include <cstdlib>
+
+#include "../util.h"
+#include "../hmac.h"
+#include "../auth.h"
+#include "../cookiecache.h"
+
+static const std::string seed = b32dec(b32pad("JBSWY3DPEHPK3PXPJBSWY3DPEHPK3PXP"));
+
+struct fuzz_state_t {
+	cookie_keys_t keys{"some-random-string-that-is-relatively-long-used-for-cookie-minting"};
+	CookieCache cache{1024}, nocache{0};
+	CookieAuth cached{&keys, &cache}, uncached{&keys, &nocache};
+	CookieAuth legacy{&keys, &nocache, false};
+	users_t users;
+
+	fuzz_state_t() {
+		// The last one is too long for compact cookies
+		const std::string names[] = {"user1", "user2", std::string(COOKIE_MAX_USER + 1, 'u')};
+		for (unsigned i = 0; i < 3; i++)
+			users[names[i]] = cred_t { PasswordHash("pass"), HmacKey(EVP_sha1(), seed), 3600, 6, 30, hAlgoSha1, i };
+	}
+};
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	static fuzz_state_t st;
+	if (!size)
+		return 0;
+	std::string_view input((const char*)&data[1], size - 1);
+
+	std::string cookie;
+	bool patched = false, issued = false;
+	if (!(data[0] & 1))
+		cookie = input;
+	else {
+		const auto *entry = st.users.at(data[0] % 3);
+		std::string orig = (data[0] & 2 ? st.legacy : st.cached).create(entry->key, entry->value);
+		cookie = orig;
+		for (size_t i = 0; i < input.size() && i < cookie.size(); i++)
+			cookie[i] ^= input[i];
+		issued = cookie == orig;
+		patched = !issued;
+	}
+
+	time_t expiry;
+	bool valid = st.uncached.owner(cookie, st.users, time(0), &expiry) != nullptr;
+	// Twice, so that the second one may come from the cache
+	for (unsigned i = 0; i < 2; i++) {
+		if (st.cached.check(cookie, "someweb.example.com", st.users) != valid)
+			abort();
+		if (st.uncached.check(cookie, "someweb.example.com", st.users) != valid)
+			abort();
+	}
+	if (issued && !valid)
+		abort();
+	if (patched && valid)
+		abort();
+	return 0;
+}
@@ -0,0 +1,38 @@
+
+// Request parsing: the zero-copy lookups (find_var, find_cookie) must agree
+// with the reference parsers (parse_vars, parse_cookies) on any input.
+// Input: first byte is the length of the name to look up, then the name,
+// then the body / cookie jar.
+
+#include <cstdlib>
+
+#include "../util.h"
+#include "../bench/reference.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	if (!size)
+		return 0;
+	size_t nlen = std::min((size_t)data[0], size - 1);
+	std::string name((const char*)&data[1], nlen);
+	std::string input((const char*)&data[1 + nlen], size - 1 - nlen);
+
+	auto vars = parse_vars(input);
+	auto vit = vars.find(name);
+	if (find_var(input, name) != (vit != vars.end() ? vit->second : ""))
+		abort();
+	// Every variable found by the parser is found by the lookup
+	for (const auto & v : vars) {
+		if (find_var(input, v.first) != v.second)
+			abort();
+	}
+
+	auto cookies = parse_cookies(input);
+	auto cit = cookies.find(name);
+	if (find_cookie(input, name) != (cit != cookies.end() ? cit->second : ""))
+		abort();
+	for (const auto & c : cookies) {
+		if (find_cookie(input, c.first) != c.second)
+			abort();
+	}
+	return 0;
+}
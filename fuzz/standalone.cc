@@ -0,0 +1,67 @@
+
+// Driver for the fuzz targets when libFuzzer isn't around (ie. built with
+// g++ and sanitizers): runs the given files and then random mutations of
+// them (or of nothing) for a while.
+// Usage: target.bin [-runs=N] [file ...]
+
+#include <vector>
+#include <string>
+#include <random>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <cstring>
+#include <cstdint>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static void run(const std::string &in) {
+	LLVMFuzzerTestOneInput((const uint8_t*)in.data(), in.size());
+}
+
+int main(int argc, char **argv) {
+	unsigned long runs = 1000000;
+	std::vector<std::string> corpus;
+	for (int i = 1; i < argc; i++) {
+		if (!strncmp(argv[i], "-runs=", 6)) {
+			runs = strtoul(argv[i] + 6, nullptr, 10);
+			continue;
+		}
+		std::ifstream ifs(argv[i], std::ios::binary);
+		corpus.emplace_back(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+		run(corpus.back());
+	}
+	if (corpus.empty())
+		corpus.emplace_back();
+
+	// Byte flips, inserts and erases (mostly of chars the parsers care about)
+	static const char special[] = "%&=; :0aF9zZ27";
+	std::mt19937_64 rng(1);
+	for (unsigned long r = 0; r < runs; r++) {
+		std::string in = corpus[rng() % corpus.size()];
+		for (unsigned m = 1 + rng() % 8; m; m--) {
+			size_t pos = in.empty() ? 0 : rng() % (in.size() + 1);
+			char c = rng() & 1 ? special[rng() % (sizeof(special) - 1)] : (char)rng();
+			switch (rng() % 3) {
+			case 0:
+				if (pos < in.size()) {
+					in[pos] = c;
+					break;
+				}
+				// Fall through
+			case 1:
+				in.insert(in.begin() + pos, c);
+				break;
+			case 2:
+				if (pos < in.size())
+					in.erase(pos, 1 + rng() % 4);
+				break;
+			}
+		}
+		run(in);
+		if (rng() % 64 == 0 && in.size() < 4096)
+			corpus.push_back(in);
+	}
+	std::cerr << "Ran " << runs << " inputs" << std::endl;
+	return 0;
+}
@@ -0,0 +1,116 @@
+
+#ifndef __HMAC__HH__
+#define __HMAC__HH__
+
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <openssl/evp.h>
+
+// HMAC with a precomputed key schedule. The inner and outer digests are
+// primed with the padded key once at construction time; signing a message
+// clones them into a per-thread scratch context and only hashes the message
+// (saving the two key block compressions that HMAC() performs every call).
+
+class HmacKey {
+private:
+	const EVP_MD *md = nullptr;
+	EVP_MD_CTX *ictx = nullptr;   // Digest after absorbing key ^ ipad
+	EVP_MD_CTX *octx = nullptr;   // Digest after absorbing key ^ opad
+
+	// Scratch context, one per thread, reused across calls
+	static EVP_MD_CTX *scratch() {
+		struct ctxholder {
+			EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+			~ctxholder() { EVP_MD_CTX_free(ctx); }
+		};
+		static thread_local ctxholder h;
+		return h.ctx;
+	}
+
+	void release() {
+		EVP_MD_CTX_free(ictx);
+		EVP_MD_CTX_free(octx);
+		ictx = octx = nullptr;
+	}
+
+	void copyfrom(const HmacKey &o) {
+		md = o.md;
+		if (o.ictx) {
+			ictx = EVP_MD_CTX_new();
+			octx = EVP_MD_CTX_new();
+			EVP_MD_CTX_copy_ex(ictx, o.ictx);
+			EVP_MD_CTX_copy_ex(octx, o.octx);
+		}
+	}
+
+public:
+	HmacKey() {}
+
+	HmacKey(const EVP_MD *md, std::string_view key) : md(md) {
+		uint8_t kblock[256] = {0}, pad[256];
+		unsigned bsize = EVP_MD_block_size(md);
+
+		// Keys longer than the block size are hashed first
+		if (key.size() > bsize) {
+			unsigned ksize = 0;
+			EVP_Digest(key.data(), key.size(), kblock, &ksize, md, NULL);
+		}
+		else
+			memcpy(kblock, key.data(), key.size());
+
+		ictx = EVP_MD_CTX_new();
+		octx = EVP_MD_CTX_new();
+		for (unsigned i = 0; i < bsize; i++)
+			pad[i] = kblock[i] ^ 0x36;
+		EVP_DigestInit_ex(ictx, md, NULL);
+		EVP_DigestUpdate(ictx, pad, bsize);
+		for (unsigned i = 0; i < bsize; i++)
+			pad[i] = kblock[i] ^ 0x5c;
+		EVP_DigestInit_ex(octx, md, NULL);
+		EVP_DigestUpdate(octx, pad, bsize);
+	}
+
+	HmacKey(const HmacKey &o) { copyfrom(o); }
+	HmacKey(HmacKey &&o) noexcept : md(o.md), ictx(o.ictx), octx(o.octx) {
+		o.ictx = o.octx = nullptr;
+	}
+	HmacKey& operator=(HmacKey o) noexcept {
+		std::swap(md, o.md);
+		std::swap(ictx, o.ictx);
+		std::swap(octx, o.octx);
+		return *this;
+	}
+	~HmacKey() { release(); }
+
+	// Size in bytes of the produced MAC
+	unsigned size() const {
+		return md ? EVP_MD_size(md) : 0;
+	}
+
+	// Writes the MAC to out (EVP_MAX_MD_SIZE bytes at most), returns its size
+	unsigned sign(const void *msg, size_t len, uint8_t *out) const {
+		if (!ictx)
+			return 0;
+
+		uint8_t ihash[EVP_MAX_MD_SIZE];
+		unsigned ilen = 0, olen = 0;
+		EVP_MD_CTX *ctx = scratch();
+		EVP_MD_CTX_copy_ex(ctx, ictx);
+		EVP_DigestUpdate(ctx, msg, len);
+		EVP_DigestFinal_ex(ctx, ihash, &ilen);
+		EVP_MD_CTX_copy_ex(ctx, octx);
+		EVP_DigestUpdate(ctx, ihash, ilen);
+		EVP_DigestFinal_ex(ctx, out, &olen);
+		return olen;
+	}
+
+	std::string sign(std::string_view msg) const {
+		uint8_t hash[EVP_MAX_MD_SIZE];
+		unsigned hsize = sign(msg.data(), msg.size(), hash);
+		return std::string((char*)hash, hsize);
+	}
+};
+
+#endif
+
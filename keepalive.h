@@ -0,0 +1,179 @@
+
+#ifndef __KEEPALIVE__HH__
+#define __KEEPALIVE__HH__
+
+#include <ctime>
+#include <mutex>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <unordered_map>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <fcgiapp.h>
+
+#include "queue.h"
+
+// Keeps the FastCGI connections nginx wants to reuse (fastcgi_keep_conn)
+// around while they are idle, so they don't pin a worker. Finished requests
+// that still hold their connection are parked here; once the next request's
+// begin and params records are all there (peeked without reading, so a slow
+// peer never blocks the poller) it's read (FCGX_Accept_r reuses the open
+// connection) and handed to ready(). Connections that close, or don't come
+// up with a request within the timeout, are closed and their request given
+// back to the pool. T must have an FCGX_Request fcgx member.
+
+#define KEEPALIVE_MAX_EVENTS    64
+#define KEEPALIVE_PEEK       (64*1024)   // Larger params close the connection
+
+template<typename T>
+class IdlePoller {
+public:
+	typedef std::function<void(T*)> ready_fn;
+
+	IdlePoller(ObjectPool<T> *pool, unsigned maxconns, unsigned timeout, ready_fn ready)
+	 : pool(pool), maxconns(maxconns), timeout(timeout), ready(ready) {
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		thread = std::thread(&IdlePoller::run, this);
+	}
+
+	// Pins the poller thread (see pin_thread)
+	void pin(const std::vector<int> &cpus, int idx = -1) {
+		pin_thread(thread.native_handle(), cpus, idx);
+	}
+
+	~IdlePoller() {
+		end = true;
+		thread.join();
+		for (auto & p : parked)
+			FCGX_Free(&p.first->fcgx, 1);
+		close(epfd);
+	}
+
+	// Parks a finished request with an open connection, returns false if
+	// there are too many idle connections already (the caller closes it).
+	bool park(T *req) {
+		std::lock_guard<std::mutex> guard(mu);
+		if (parked.size() >= maxconns)
+			return false;
+		// Never fall back to accepting a new connection if this one fails
+		req->fcgx.listen_sock = -1;
+		parked[req] = { time(0), false };
+
+		struct epoll_event ev = {};
+		ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+		ev.data.ptr = req;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, req->fcgx.ipcFd, &ev);
+		return true;
+	}
+
+	// Number of idle connections parked right now
+	unsigned idle() {
+		std::lock_guard<std::mutex> guard(mu);
+		return parked.size();
+	}
+
+private:
+	// Takes a request out of the idle set (false if it wasn't there)
+	bool unpark(T *req) {
+		std::lock_guard<std::mutex> guard(mu);
+		if (!parked.erase(req))
+			return false;
+		epoll_ctl(epfd, EPOLL_CTL_DEL, req->fcgx.ipcFd, nullptr);
+		return true;
+	}
+
+	// Whether the begin and params records of the next request are there
+	// already (so FCGX_Accept_r won't block), or 0 if more are needed. -1
+	// if they can't be: the peer closed or params don't fit KEEPALIVE_PEEK.
+	static int peek_request(int fd, bool hup) {
+		static thread_local char buf[KEEPALIVE_PEEK];
+		ssize_t len = recv(fd, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT);
+		if (len <= 0)
+			return len < 0 && (errno == EAGAIN || errno == EINTR) && !hup ? 0 : -1;
+
+		// Look for the empty params record that ends them
+		const uint8_t *p = (const uint8_t*)buf;
+		for (size_t off = 0; off + 8 <= (size_t)len;) {
+			size_t clen = (p[off + 4] << 8) | p[off + 5];
+			if (p[off + 1] == 4 /* FCGI_PARAMS */ && !clen)
+				return 1;
+			off += 8 + clen + p[off + 6];
+		}
+		return hup || len == sizeof(buf) ? -1 : 0;
+	}
+
+	void run() {
+		struct epoll_event evs[KEEPALIVE_MAX_EVENTS];
+		time_t lastexp = time(0);
+		while (!end) {
+			int n = epoll_wait(epfd, evs, KEEPALIVE_MAX_EVENTS, 1000);
+			for (int i = 0; i < n; i++) {
+				T *req = (T*)evs[i].data.ptr;
+				int st = peek_request(req->fcgx.ipcFd, evs[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR));
+				if (!st) {
+					// Partial request, wait for more to come (edge triggered,
+					// the data peeked is still there), the timeout still applies
+					std::lock_guard<std::mutex> guard(mu);
+					auto it = parked.find(req);
+					if (it != parked.end() && !it->second.partial) {
+						it->second.partial = true;
+						struct epoll_event ev = {};
+						ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+						ev.data.ptr = req;
+						epoll_ctl(epfd, EPOLL_CTL_MOD, req->fcgx.ipcFd, &ev);
+					}
+					continue;
+				}
+				if (!unpark(req))
+					continue;
+				if (st > 0 && FCGX_Accept_r(&req->fcgx) >= 0)
+					ready(req);
+				else {
+					if (st < 0)
+						FCGX_Free(&req->fcgx, 1);
+					pool->release(req);   // Closed by the peer (or by libfcgi)
+				}
+			}
+
+			// Close the connections that have been idle for too long
+			time_t now = time(0);
+			if (now == lastexp)
+				continue;
+			lastexp = now;
+			std::vector<T*> expired;
+			{
+				std::lock_guard<std::mutex> guard(mu);
+				for (auto & p : parked)
+					if (now - p.second.since >= (time_t)timeout)
+						expired.push_back(p.first);
+			}
+			for (T *req : expired) {
+				if (unpark(req)) {
+					FCGX_Free(&req->fcgx, 1);
+					pool->release(req);
+				}
+			}
+		}
+	}
+
+	ObjectPool<T> *pool;
+	unsigned maxconns, timeout;
+	ready_fn ready;
+	int epfd;
+	std::thread thread;
+	std::atomic<bool> end{false};
+
+	struct parked_t {
+		time_t since;     // Parked at
+		bool partial;     // Part of the next request came in (edge triggered)
+	};
+
+	std::mutex mu;
+	std::unordered_map<T*, parked_t> parked;
+};
+
+#endif
+
@@ -1,21 +1,37 @@
 
+
 #ifndef __LOGGING__HH__
 #define __LOGGING__HH__
 
 #include <mutex>
 #include <ctime>
+#include <chrono>
 #include <thread>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstring>
+#include <string_view>
 #include <condition_variable>
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "metrics.h"
+
+#define LOG_TS_LEN       15   // YYYYmmdd-HHMMSS
+#define LOG_FLUSH_MS    100   // Max time lines sit in memory
 
-static time_t last_midnight() {
+static inline time_t last_midnight() {
 	time_t t = time(NULL);
 	t -= (t % 86400);
 	return t;
 }
 
-static std::string logts(bool date = false) {
+static inline std::string logts(bool date = false) {
 	char fmtime[128];
 
 	std::chrono::duration<long>seccnt(time(NULL));
@@ -30,8 +46,18 @@ static std::string logts(bool date = false) {
 
 class Logger {
 public:
-	Logger(std::string logfile)
-	 : logfile(logfile) {
+	// Every thread that logs gets a ring of ringsize bytes (rounded up to a
+	// power of two), lines that don't fit are dropped (and accounted). Logs
+	// are rotated daily and, if maxsize is set, whenever they reach it. With
+	// sync_ms they are also synced to disk at most that often (milliseconds).
+	// Write errors are counted in metrics (if any).
+	Logger(std::string logfile, size_t ringsize = 256*1024, size_t maxsize = 0, unsigned sync_ms = 0,
+	       Metrics *metrics = nullptr)
+	 : maxsize(maxsize), sync_ms(sync_ms), metrics(metrics), logfile(logfile) {
+		this->ringsize = 4096;
+		while (this->ringsize < ringsize)
+			this->ringsize <<= 1;
+
 		// Create/append first log file
 		rotatelog();
 
@@ -49,92 +75,265 @@ public:
 
 		// Wait for thread
 		flusher.join();
+		if (logfd >= 0) {
+			if (sync_ms)
+				fdatasync(logfd);
+			close(logfd);
+		}
 	}
 
-	void log(std::string line) {
-		// Add line to memory buffer
-		std::lock_guard<std::mutex> guard(mu);
-		logbuffer += logts() + " " + line + "\n";
+	// Pins the flusher thread (see pin_thread)
+	void pin(const std::vector<int> &cpus) {
+		pin_thread(flusher.native_handle(), cpus);
+	}
 
-		// Tell flusher to flush this (lazily)
-		waitcond.notify_all();
+	void log(std::string_view line) {
+		// Add line to this thread's buffer, no locking involved
+		ring_t *r = myring();
+		size_t need = LOG_TS_LEN + line.size() + 2;
+		size_t head = r->head.load(std::memory_order_relaxed);
+		size_t used = head - r->tail.load(std::memory_order_acquire);
+		if (used + need > ringsize) {
+			r->dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		time_t now = time(NULL);
+		if (now != r->tssec) {
+			r->tssec = now;
+			memcpy(r->tsbuf, logts().c_str(), LOG_TS_LEN);
+			r->tsbuf[LOG_TS_LEN] = ' ';
+		}
+		put(r, head, r->tsbuf, LOG_TS_LEN + 1);
+		put(r, head + LOG_TS_LEN + 1, line.data(), line.size());
+		put(r, head + need - 1, "\n", 1);
+		r->head.store(head + need, std::memory_order_release);
+
+		// Tell flusher when we are filling up (it flushes periodically anyway)
+		if (used + need > ringsize / 2)
+			waitcond.notify_all();
+	}
+
+	// Number of lines dropped so far due to full buffers
+	uint64_t dropped() {
+		std::lock_guard<std::mutex> guard(ringsmu);
+		uint64_t ret = 0;
+		for (const auto & r : rings)
+			ret += r->dropped.load(std::memory_order_relaxed);
+		return ret;
 	}
 
 private:
+	// Single producer (owner thread) single consumer (flusher) byte ring
+	struct ring_t {
+		std::unique_ptr<char[]> buf;
+		alignas(64) std::atomic<size_t> head{0};     // Written by the producer
+		alignas(64) std::atomic<size_t> tail{0};     // Written by the flusher
+		std::atomic<uint64_t> dropped{0};            // Lines that didn't fit
+		time_t tssec = 0;                            // Cached timestamp string
+		char tsbuf[LOG_TS_LEN + 1];
+	};
+
+	ring_t *myring() {
+		// Keyed by instance id, a new logger may reuse the address of an old one
+		static thread_local uint64_t owner = 0;
+		static thread_local ring_t *ring = nullptr;
+		if (owner != id) {
+			std::unique_ptr<ring_t> r(new ring_t());
+			r->buf.reset(new char[ringsize]);
+			ring = r.get();
+			owner = id;
+			std::lock_guard<std::mutex> guard(ringsmu);
+			rings.push_back(std::move(r));
+		}
+		return ring;
+	}
 
+	void put(ring_t *r, size_t pos, const char *data, size_t len) {
+		size_t off = pos & (ringsize - 1);
+		size_t first = std::min(len, ringsize - off);
+		memcpy(&r->buf[off], data, first);
+		memcpy(&r->buf[0], data + first, len - first);
+	}
+
+	// Opens the log for today, or the next one if the current one is full.
+	// Files are named logfile_YYYYmmdd, then logfile_YYYYmmdd.1 and so on.
 	void rotatelog() {
-		// Try to rotate the log
 		std::string localtime = logts(true);
-		if (this->logdate == localtime && logfd >= 0)
+		bool full = maxsize && written >= maxsize;
+		if (this->logdate == localtime && logfd >= 0 && !full)
 			return;   // Already using that log
 
+		if (this->logdate != localtime)
+			seq = 0;
+		else if (full)
+			seq++;
 		this->logdate = localtime;
-		if (logfd >= 0)
+		if (logfd >= 0) {
+			if (sync_ms)
+				fdatasync(logfd);
 			close(logfd);
+		}
 
-		std::string fn = logfile + "_" + this->logdate;
-		logfd = open(fn.c_str(), O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR);
+		// Skip those filled up already (ie. before a restart)
+		while (true) {
+			std::string fn = logfile + "_" + this->logdate + (seq ? "." + std::to_string(seq) : "");
+			logfd = open(fn.c_str(), O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR);
+			struct stat st;
+			written = (logfd >= 0 && !fstat(logfd, &st)) ? st.st_size : 0;
+			if (logfd < 0 || !maxsize || written < maxsize)
+				break;
+			close(logfd);
+			seq++;
+		}
 
 		// Next run
 		next_rotation = last_midnight() + 24*60*60;
 	}
 
+	void write_error() {
+		if (metrics)
+			metrics->inc(ctLogWriteErrors);
+	}
+
+	// Writes whatever the rings hold, returns false if writing failed
+	bool drain() {
+		std::vector<ring_t*> rs;
+		{
+			std::lock_guard<std::mutex> guard(ringsmu);
+			for (const auto & r : rings)
+				rs.push_back(r.get());
+		}
+
+		// Report dropped lines (as a log line of our own)
+		uint64_t ndropped = 0;
+		for (ring_t *r : rs)
+			ndropped += r->dropped.load(std::memory_order_relaxed);
+		if (ndropped != reported_drops) {
+			std::string l = logts() + " Logger dropped " + std::to_string(ndropped - reported_drops) +
+			                " lines (buffers full)\n";
+			ssize_t w = write(logfd, l.data(), l.size());
+			if (w > 0) {
+				reported_drops = ndropped;
+				written += w;
+			}
+		}
+
+		// Gather up to two segments per ring, write them all in one go
+		std::vector<struct iovec> iov;
+		std::vector<size_t> heads(rs.size());
+		for (unsigned i = 0; i < rs.size(); i++) {
+			ring_t *r = rs[i];
+			size_t tail = r->tail.load(std::memory_order_relaxed);
+			heads[i] = r->head.load(std::memory_order_acquire);
+			size_t len = heads[i] - tail, off = tail & (ringsize - 1);
+			size_t first = std::min(len, ringsize - off);
+			if (first)
+				iov.push_back({&r->buf[off], first});
+			if (len - first)
+				iov.push_back({&r->buf[0], len - first});
+		}
+
+		size_t done = 0;
+		while (done < iov.size()) {
+			int cnt = std::min(iov.size() - done, (size_t)IOV_MAX);
+			ssize_t w = writev(logfd, &iov[done], cnt);
+			if (w <= 0) {
+				write_error();
+				break;
+			}
+			written += w;
+			// Advance as many (partial) segments as written
+			while (w > 0) {
+				size_t adv = std::min((size_t)w, iov[done].iov_len);
+				iov[done].iov_base = (char*)iov[done].iov_base + adv;
+				iov[done].iov_len -= adv;
+				w -= adv;
+				if (!iov[done].iov_len)
+					done++;
+			}
+		}
+
+		// Release the written space, segments are in ring order
+		size_t seg = 0;
+		for (unsigned i = 0; i < rs.size(); i++) {
+			ring_t *r = rs[i];
+			size_t tail = r->tail.load(std::memory_order_relaxed);
+			size_t len = heads[i] - tail, off = tail & (ringsize - 1);
+			size_t nsegs = (len ? 1 : 0) + (len > ringsize - off ? 1 : 0);
+			size_t released = 0;
+			for (unsigned j = 0; j < nsegs; j++, seg++) {
+				size_t seglen = (j == 0) ? std::min(len, ringsize - off) : len - (ringsize - off);
+				released += seglen - iov[seg].iov_len;
+			}
+			r->tail.store(tail + released, std::memory_order_release);
+		}
+
+		return done == iov.size();
+	}
+
 	void flushthread() {
 		// Keeps flushing logs to disk periodically
+		uint64_t last_sync = mono_ns();
 		while (true) {
-			std::unique_lock<std::mutex> lock(waitmu);
-			waitcond.wait(lock);
-
-			bool empty = false;
-			do {
-				// Read buffer we want to write
-				std::string chunk;
-				{
-					std::lock_guard<std::mutex> guard(mu);
-					chunk = logbuffer.substr(0, 256*1024);
-				}
-
-				// Try to write as much as possible
-				int writtenbytes = 0;
-				while (!chunk.empty()) {
-					int w = write(logfd, &chunk[writtenbytes], chunk.size() - writtenbytes);
-					if (w > 0)
-						writtenbytes += w;
-					else
-						break;
-				}
-
-				// Remove the written bits
-				{
-					std::lock_guard<std::mutex> guard(mu);
-					logbuffer = logbuffer.substr(writtenbytes);
-					empty = logbuffer.empty();
-				}
-
-				// Check log rotation
-				if (time(NULL) > next_rotation && empty)
-					rotatelog();
-			} while (!empty);
-
-			if (end)
+			{
+				std::unique_lock<std::mutex> lock(waitmu);
+				if (!end)
+					waitcond.wait_for(lock, std::chrono::milliseconds(LOG_FLUSH_MS));
+			}
+
+			// Check log rotation (we are the only writer), also retry opening
+			// the log if that failed
+			if (time(NULL) > next_rotation || (maxsize && written >= maxsize) || logfd < 0)
+				rotatelog();
+
+			// On shutdown keep trying a few times before giving up. Lines
+			// logged before the end was signaled must make it.
+			bool last = end;
+			uint64_t before = written;
+			bool ok = drain();
+			if (last && (ok || ++failures > 3))
 				break;
+
+			// Sync in batches, not after every write
+			unsynced |= written != before;
+			if (sync_ms && unsynced && mono_ns() - last_sync >= sync_ms * 1000000ULL) {
+				if (fdatasync(logfd))
+					write_error();
+				last_sync = mono_ns();
+				unsynced = false;
+			}
 		}
 	}
 
-	// List of stuff to be flushed
-	std::string logbuffer;
-	std::mutex mu;
+	// Per thread buffers
+	static uint64_t next_id() {
+		static std::atomic<uint64_t> ids{0};
+		return ++ids;
+	}
+	const uint64_t id = next_id();
+	std::vector<std::unique_ptr<ring_t>> rings;
+	std::mutex ringsmu;
+	size_t ringsize;
+	uint64_t reported_drops = 0;
 
 	// Thread that sits in the background flushing stuff
 	std::thread flusher;
 	std::mutex waitmu;
 	std::condition_variable waitcond;
 	std::string logdate;
-	bool end = false;
+	std::atomic<bool> end{false};
+	unsigned failures = 0;
 
 	// Log management
+	size_t maxsize;
+	unsigned sync_ms;
+	Metrics *metrics;
 	std::string logfile;
 	int logfd = -1;
+	unsigned seq = 0;          // Files rotated today because of their size
+	uint64_t written = 0;      // Current file size
+	bool unsynced = false;     // Written since the last sync
 	time_t next_rotation = 0;
 };
 
@@ -0,0 +1,280 @@
+
+
+#ifndef __METRICS__HH__
+#define __METRICS__HH__
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <string_view>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+// Request counters and latency histograms, exposed in the Prometheus text
+// format. Every thread records into its own shard (plain relaxed stores, no
+// RMW nor locking), the shards are only summed up when scraped.
+
+// Histograms are log-linear (HDR style): values (in ns) below 1us go to the
+// first bucket, then every power of two is split in 4 sub-buckets (so about
+// 25% precision) up to ~17s, anything bigger goes to the last bucket.
+#define HIST_MIN_SHIFT   10
+#define HIST_OCTAVES     24
+#define HIST_SUBBITS      2
+#define HIST_BUCKETS     (HIST_OCTAVES * (1 << HIST_SUBBITS) + 2)
+
+enum mEndpoint { epAuth, epLogin, epLogout, epMetrics, epOther, epCount };
+enum mStage { stQueueWait, stParse, stCookie, stTotp, stPassword, stRender, stCount };
+
+// Plain event counters
+enum mCounter { ctLaneAuthRejected, ctLaneOtherRejected, ctQueueRejected,
+                ctClusterSent, ctClusterReceived, ctClusterRejected,
+                ctLogWriteErrors, ctAuditWriteErrors, ctShedAuth, ctShedOther, ctCount };
+
+static const char * const metric_counters[ctCount][2] = {
+	{"totp_lane_rejected_total{lane=\"auth\"}", "Requests rejected because their queue lane was full."},
+	{"totp_lane_rejected_total{lane=\"other\"}", nullptr},
+	{"totp_queue_rejected_total", "Requests rejected because the work queue was full."},
+	{"totp_cluster_hits_total{dir=\"sent\"}", "Login hits shared with (or received from) cluster peers."},
+	{"totp_cluster_hits_total{dir=\"received\"}", nullptr},
+	{"totp_cluster_rejected_total", "Cluster datagrams dropped for a bad MAC or timestamp."},
+	{"totp_log_write_errors_total{log=\"text\"}", "Failed log writes (or syncs)."},
+	{"totp_log_write_errors_total{log=\"audit\"}", nullptr},
+	{"totp_deadline_shed_total{lane=\"auth\"}", "Requests answered with a 503 for waiting past queue_deadline."},
+	{"totp_deadline_shed_total{lane=\"other\"}", nullptr},
+};
+
+static const char * const metric_endpoints[epCount] = {"/auth", "/login", "/logout", "/metrics", "other"};
+static const char * const metric_stages[stCount] = {"queue_wait", "parse", "check_cookie", "totp_valid", "password", "render"};
+static const unsigned metric_codes[] = {200, 302, 401, 404, 429, 500, 503};
+#define METRIC_CODES     (sizeof(metric_codes) / sizeof(metric_codes[0]) + 1)   // Plus "other"
+#define METRICS_SPARE_HOSTS  256   // Room for hosts added by config reloads
+
+static inline uint64_t mono_ns() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline mEndpoint metric_endpoint(std::string_view uri) {
+	for (unsigned i = 0; i < epOther; i++)
+		if (uri == metric_endpoints[i])
+			return (mEndpoint)i;
+	return epOther;
+}
+
+class Metrics {
+public:
+	// Hosts are identified by their index in hostnames, up to maxhosts of
+	// them. Unknown hosts (and any id past maxhosts) are accounted together.
+	Metrics(std::vector<std::string> hostnames, unsigned maxhosts, bool exposed)
+	 : hostnames(std::move(hostnames)), maxhosts(maxhosts), expose(exposed) {}
+
+	// Updates the host names (ie. after a config reload), ids are kept
+	void set_hostnames(std::vector<std::string> names) {
+		std::lock_guard<std::mutex> guard(shardsmu);
+		hostnames = std::move(names);
+	}
+
+	// Whether the /metrics endpoint should serve them
+	bool exposed() const { return expose; }
+
+	void count(unsigned hostid, mEndpoint ep, unsigned status) {
+		unsigned code = 0;
+		while (code < METRIC_CODES - 1 && metric_codes[code] != status)
+			code++;
+		hostid = std::min(hostid, maxhosts);
+		bump(&myshard()->requests[(hostid * epCount + ep) * METRIC_CODES + code], 1);
+	}
+
+	void stage(mStage st, uint64_t ns) {
+		myshard()->stages[st].record(ns);
+	}
+
+	void total(mEndpoint ep, uint64_t ns) {
+		myshard()->totals[ep].record(ns);
+	}
+
+	void inc(mCounter ct, uint64_t n = 1) {
+		bump(&myshard()->counters[ct], n);
+	}
+
+	// Number of workers taking requests (shown as a gauge)
+	void set_workers(unsigned n) {
+		workers.store(n, std::memory_order_relaxed);
+	}
+
+	// Totals so far (summed across threads): requests served, the time they
+	// waited in the queue and the time spent serving them, in ns
+	void load(uint64_t *requests, uint64_t *wait_ns, uint64_t *busy_ns) {
+		uint64_t n = 0, wait = 0, total = 0;
+		std::lock_guard<std::mutex> guard(shardsmu);
+		for (const auto & s : shards) {
+			for (unsigned i = 0; i < epCount; i++) {
+				for (unsigned b = 0; b < HIST_BUCKETS; b++)
+					n += s->totals[i].buckets[b].load(std::memory_order_relaxed);
+				total += s->totals[i].sum.load(std::memory_order_relaxed);
+			}
+			wait += s->stages[stQueueWait].sum.load(std::memory_order_relaxed);
+		}
+		*requests = n;
+		*wait_ns = wait;
+		*busy_ns = total > wait ? total - wait : 0;
+	}
+
+	// Renders all the metrics (summed across threads)
+	std::string render(uint64_t log_dropped) {
+		std::vector<uint64_t> reqs((maxhosts + 1) * epCount * METRIC_CODES);
+		histogram_t stages[stCount], totals[epCount];
+		uint64_t counters[ctCount] = {0};
+		std::vector<std::string> names;
+		{
+			std::lock_guard<std::mutex> guard(shardsmu);
+			names = hostnames;
+			for (const auto & s : shards) {
+				for (unsigned i = 0; i < reqs.size(); i++)
+					reqs[i] += s->requests[i].load(std::memory_order_relaxed);
+				for (unsigned i = 0; i < stCount; i++)
+					stages[i].add(s->stages[i]);
+				for (unsigned i = 0; i < epCount; i++)
+					totals[i].add(s->totals[i]);
+				for (unsigned i = 0; i < ctCount; i++)
+					counters[i] += s->counters[i].load(std::memory_order_relaxed);
+			}
+		}
+
+		std::string ret;
+		ret += "# HELP totp_requests_total Requests served by host, endpoint and status code.\n";
+		ret += "# TYPE totp_requests_total counter\n";
+		for (unsigned h = 0; h <= maxhosts; h++)
+			for (unsigned e = 0; e < epCount; e++)
+				for (unsigned c = 0; c < METRIC_CODES; c++) {
+					uint64_t v = reqs[(h * epCount + e) * METRIC_CODES + c];
+					if (!v)
+						continue;
+					ret += "totp_requests_total{host=\"" + (h < maxhosts && h < names.size() ? names[h] : "unknown") +
+					       "\",endpoint=\"" + metric_endpoints[e] + "\",code=\"" +
+					       (c < METRIC_CODES - 1 ? std::to_string(metric_codes[c]) : "other") + "\"} " +
+					       std::to_string(v) + "\n";
+				}
+
+		ret += "# HELP totp_stage_duration_seconds Time spent in each request processing stage.\n";
+		ret += "# TYPE totp_stage_duration_seconds histogram\n";
+		for (unsigned i = 0; i < stCount; i++)
+			stages[i].render(&ret, "totp_stage_duration_seconds", std::string("stage=\"") + metric_stages[i] + "\"");
+
+		ret += "# HELP totp_request_duration_seconds Time from accept to response written by endpoint.\n";
+		ret += "# TYPE totp_request_duration_seconds histogram\n";
+		for (unsigned i = 0; i < epCount; i++)
+			totals[i].render(&ret, "totp_request_duration_seconds", std::string("endpoint=\"") + metric_endpoints[i] + "\"");
+
+		// Counters sharing a name (with different labels) come one after the other
+		for (unsigned i = 0; i < ctCount; i++) {
+			if (metric_counters[i][1]) {
+				std::string name(metric_counters[i][0], strcspn(metric_counters[i][0], "{"));
+				ret += "# HELP " + name + " " + metric_counters[i][1] + "\n";
+				ret += "# TYPE " + name + " counter\n";
+			}
+			ret += std::string(metric_counters[i][0]) + " " + std::to_string(counters[i]) + "\n";
+		}
+
+		if (unsigned w = workers.load(std::memory_order_relaxed)) {
+			ret += "# HELP totp_workers Workers taking requests.\n";
+			ret += "# TYPE totp_workers gauge\n";
+			ret += "totp_workers " + std::to_string(w) + "\n";
+		}
+
+		ret += "# HELP totp_log_dropped_total Log lines dropped due to full buffers.\n";
+		ret += "# TYPE totp_log_dropped_total counter\n";
+		ret += "totp_log_dropped_total " + std::to_string(log_dropped) + "\n";
+		return ret;
+	}
+
+private:
+	// Only the owner thread writes, so a load and a store is enough
+	static void bump(std::atomic<uint64_t> *v, uint64_t n) {
+		v->store(v->load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	struct histogram_t {
+		std::atomic<uint64_t> buckets[HIST_BUCKETS] = {};
+		std::atomic<uint64_t> sum{0};   // In ns
+
+		static unsigned bucket(uint64_t ns) {
+			if (ns < (1ULL << HIST_MIN_SHIFT))
+				return 0;
+			unsigned msb = 63 - __builtin_clzll(ns);
+			unsigned sub = (ns >> (msb - HIST_SUBBITS)) & ((1 << HIST_SUBBITS) - 1);
+			unsigned idx = 1 + ((msb - HIST_MIN_SHIFT) << HIST_SUBBITS) + sub;
+			return std::min(idx, (unsigned)HIST_BUCKETS - 1);
+		}
+
+		// Upper bound (exclusive) of a bucket in ns, the last one has none
+		static uint64_t bound(unsigned idx) {
+			if (!idx)
+				return 1ULL << HIST_MIN_SHIFT;
+			unsigned oct = (idx - 1) >> HIST_SUBBITS, sub = (idx - 1) & ((1 << HIST_SUBBITS) - 1);
+			return (uint64_t)((1 << HIST_SUBBITS) + sub + 1) << (oct + HIST_MIN_SHIFT - HIST_SUBBITS);
+		}
+
+		void record(uint64_t ns) {
+			bump(&buckets[bucket(ns)], 1);
+			bump(&sum, ns);
+		}
+
+		void add(const histogram_t &h) {
+			for (unsigned i = 0; i < HIST_BUCKETS; i++)
+				bump(&buckets[i], h.buckets[i].load(std::memory_order_relaxed));
+			bump(&sum, h.sum.load(std::memory_order_relaxed));
+		}
+
+		void render(std::string *out, const char *name, const std::string &labels) const {
+			char num[32];
+			uint64_t cumul = 0;
+			for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+				cumul += buckets[i].load(std::memory_order_relaxed);
+				if (i < HIST_BUCKETS - 1)
+					snprintf(num, sizeof(num), "%g", bound(i) / 1e9);
+				*out += std::string(name) + "_bucket{" + labels + ",le=\"" +
+				        (i < HIST_BUCKETS - 1 ? num : "+Inf") + "\"} " + std::to_string(cumul) + "\n";
+			}
+			snprintf(num, sizeof(num), "%.9f", sum.load(std::memory_order_relaxed) / 1e9);
+			*out += std::string(name) + "_sum{" + labels + "} " + num + "\n";
+			*out += std::string(name) + "_count{" + labels + "} " + std::to_string(cumul) + "\n";
+		}
+	};
+
+	struct shard_t {
+		std::unique_ptr<std::atomic<uint64_t>[]> requests;   // [host][endpoint][code]
+		histogram_t stages[stCount];
+		histogram_t totals[epCount];
+		std::atomic<uint64_t> counters[ctCount] = {};
+	};
+
+	shard_t *myshard() {
+		static thread_local Metrics *owner = nullptr;
+		static thread_local shard_t *shard = nullptr;
+		if (owner != this) {
+			std::unique_ptr<shard_t> s(new shard_t());
+			size_t n = (maxhosts + 1) * epCount * METRIC_CODES;
+			s->requests.reset(new std::atomic<uint64_t>[n]());
+			shard = s.get();
+			owner = this;
+			std::lock_guard<std::mutex> guard(shardsmu);
+			shards.push_back(std::move(s));
+		}
+		return shard;
+	}
+
+	std::vector<std::string> hostnames;
+	unsigned maxhosts;
+	bool expose;
+	std::atomic<unsigned> workers{0};
+	std::vector<std::unique_ptr<shard_t>> shards;
+	std::mutex shardsmu;
+};
+
+#endif
+
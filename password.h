@@ -0,0 +1,183 @@
+
+#ifndef __PASSWORD__HH__
+#define __PASSWORD__HH__
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <cstdlib>
+#include <condition_variable>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+
+#include "util.h"
+#include "queue.h"
+
+// Password verification. Passwords can be configured in plain text or as
+// hashes, with salt and hash base64url encoded (no padding):
+//   $pbkdf2-sha256$iterations$salt$hash   (also pbkdf2-sha512)
+//   $scrypt$N$r$p$salt$hash
+
+#define PW_MAX_HASH     64
+
+class PasswordHash {
+public:
+	enum pwType { pwInvalid, pwPlain, pwPbkdf2, pwScrypt };
+
+	PasswordHash() {}
+	PasswordHash(std::string_view spec) {
+		if (spec.substr(0, 8) != "$pbkdf2-" && spec.substr(0, 8) != "$scrypt$") {
+			type = pwPlain;
+			secret = std::string(spec);
+			return;
+		}
+
+		std::vector<std::string_view> f;
+		spec.remove_prefix(1);
+		while (1) {
+			size_t p = spec.find('$');
+			f.push_back(spec.substr(0, p));
+			if (p == std::string_view::npos)
+				break;
+			spec.remove_prefix(p + 1);
+		}
+
+		if (f.size() == 4 && (f[0] == "pbkdf2-sha256" || f[0] == "pbkdf2-sha512")) {
+			type = pwPbkdf2;
+			md = f[0] == "pbkdf2-sha256" ? EVP_sha256() : EVP_sha512();
+			n = strtoull(std::string(f[1]).c_str(), nullptr, 10);
+			if (!n || !decode(f[2], &salt) || !decode(f[3], &secret))
+				type = pwInvalid;
+		}
+		else if (f.size() == 6 && f[0] == "scrypt") {
+			type = pwScrypt;
+			n = strtoull(std::string(f[1]).c_str(), nullptr, 10);
+			r = strtoull(std::string(f[2]).c_str(), nullptr, 10);
+			p = strtoull(std::string(f[3]).c_str(), nullptr, 10);
+			if (!n || (n & (n - 1)) || !r || !p || !decode(f[4], &salt) || !decode(f[5], &secret))
+				type = pwInvalid;
+		}
+	}
+
+	bool valid() const { return type != pwInvalid; }
+
+	// Same scheme and cost, but with a random salt and hash that nothing
+	// matches. Verified for unknown users, so they take as long as known ones.
+	PasswordHash decoy() const {
+		PasswordHash ret = *this;
+		for (std::string *f : {&ret.salt, &ret.secret})
+			RAND_bytes((uint8_t*)&(*f)[0], f->size());
+		return ret;
+	}
+
+	// Whether verification is expensive (and should be done in the pool)
+	bool hashed() const { return type == pwPbkdf2 || type == pwScrypt; }
+
+	bool verify(std::string_view pass) const {
+		uint8_t out[PW_MAX_HASH];
+		switch (type) {
+		case pwPlain:
+			return pass.size() == secret.size() && !CRYPTO_memcmp(pass.data(), secret.data(), pass.size());
+		case pwPbkdf2:
+			if (!PKCS5_PBKDF2_HMAC(pass.data(), pass.size(), (const uint8_t*)salt.data(), salt.size(),
+			                       n, md, secret.size(), out))
+				return false;
+			break;
+		case pwScrypt:
+			// Allow for the memory the parameters need (128 * N * r plus some)
+			if (!EVP_PBE_scrypt(pass.data(), pass.size(), (const uint8_t*)salt.data(), salt.size(),
+			                    n, r, p, 130 * n * r + (1 << 20), out, secret.size()))
+				return false;
+			break;
+		default:
+			return false;
+		}
+		return !CRYPTO_memcmp(out, secret.data(), secret.size());
+	}
+
+private:
+	static bool decode(std::string_view b64, std::string *out) {
+		uint8_t buf[PW_MAX_HASH];
+		int l = b64urldecode(b64, buf, sizeof(buf));
+		if (l <= 0)
+			return false;
+		out->assign((char*)buf, l);
+		return true;
+	}
+
+	pwType type = pwInvalid;
+	const EVP_MD *md = nullptr;
+	uint64_t n = 0, r = 0, p = 0;    // Iterations or scrypt cost parameters
+	std::string salt;
+	std::string secret;              // Plain text password or hash
+};
+
+// Runs hashed password verifications on a few dedicated threads, so that a
+// login flood can only keep those busy. At most maxqueue verifications can
+// be pending (queued or running), beyond that they are rejected right away
+// and the caller should tell the client to retry later.
+class VerifyPool {
+public:
+	VerifyPool(unsigned nthreads, unsigned maxqueue)
+	 : maxqueue(maxqueue), jobs(maxqueue) {
+		for (unsigned i = 0; i < nthreads; i++)
+			threads.emplace_back(&VerifyPool::work, this);
+	}
+
+	~VerifyPool() {
+		jobs.close();
+		for (auto & t : threads)
+			t.join();
+	}
+
+	// Returns 1 if the password matches, 0 if not, -1 if too busy
+	int verify(const PasswordHash &h, std::string_view pass) {
+		if (!h.hashed())
+			return h.verify(pass);
+
+		if (pending.fetch_add(1, std::memory_order_relaxed) >= maxqueue) {
+			pending.fetch_sub(1, std::memory_order_relaxed);
+			return -1;
+		}
+
+		job_t job = { &h, pass };
+		jobs.push(&job);
+		std::unique_lock<std::mutex> lock(job.mu);
+		while (!job.done)
+			job.cond.wait(lock);
+		return job.result;
+	}
+
+private:
+	struct job_t {
+		const PasswordHash *h;
+		std::string_view pass;
+		bool done = false, result = false;
+		std::mutex mu;
+		std::condition_variable cond;
+	};
+
+	void work() {
+		job_t *job;
+		while (jobs.pop(&job)) {
+			bool res = job->h->verify(job->pass);
+			pending.fetch_sub(1, std::memory_order_relaxed);
+			std::lock_guard<std::mutex> guard(job->mu);
+			job->result = res;
+			job->done = true;
+			job->cond.notify_one();
+		}
+	}
+
+	unsigned maxqueue;
+	std::atomic<unsigned> pending{0};
+	RingQueue<job_t*> jobs;
+	std::vector<std::thread> threads;
+};
+
+#endif
+
@@ -1,33 +1,62 @@
 
+#ifndef __QUEUE__HH__
+#define __QUEUE__HH__
+
+#include <list>
+#include <memory>
 #include <atomic>
+#include <chrono>
 #include <mutex>
 #include <condition_variable>
 
+#include "util.h"
+
+// Blocking multi producer / multi consumer queue interface
+template<typename T>
+class WorkQueue {
+public:
+	virtual ~WorkQueue() {}
+	// Signals no more items will be pushed, wakes up all consumers
+	virtual void close() = 0;
+	// Pushes an item, might block if the queue is bounded and full
+	virtual void push(T item) = 0;
+	// Pushes an item if that can be done without blocking
+	virtual bool offer(T &item) = 0;
+	// Blocks until an item is available, returns false once the queue is
+	// closed and empty (items left on close are still handed out)
+	virtual bool pop(T *item) noexcept = 0;
+};
+
 template<typename T>
-class ConcurrentQueue {
+class ConcurrentQueue : public WorkQueue<T> {
 public:
 	ConcurrentQueue() : nowriter(false) {}
 
-	void close() {
+	void close() override {
 		std::unique_lock<std::mutex> lock(mutex_);
 		nowriter = true;
 		condvar.notify_all();
 	}
 
-	void push(T item) {
+	void push(T item) override {
 		std::unique_lock<std::mutex> lock(mutex_);
 		q.push_back(std::move(item));
 		lock.unlock();
 		condvar.notify_one();
 	}
 
-	bool pop(T *item) noexcept {
+	bool offer(T &item) override {
+		push(std::move(item));
+		return true;
+	}
+
+	bool pop(T *item) noexcept override {
 		std::unique_lock<std::mutex> lock(mutex_);
 		while (q.empty() && !nowriter)
 			condvar.wait(lock);
 
-		// Writer signaled end already
-		if (nowriter)
+		// Writer signaled end already and everything was handed out
+		if (q.empty())
 			return false;
 
 		*item = std::move(q.front());
@@ -42,4 +71,339 @@ private:
 	std::atomic<bool> nowriter;      // Indicates no more writes will happen
 };
 
+// Waits for a condition by spinning for a short while and then blocking,
+// so that the common back-to-back case never touches the mutex/condvar.
+class Parker {
+public:
+	template<typename F>
+	void wait(F ready) {
+		for (unsigned i = 0; i < spin_iters; i++) {
+			if (ready())
+				return;
+			cpu_relax();
+		}
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		waiters++;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		while (!ready())
+			condvar.wait(lock);
+		waiters--;
+	}
+
+	// Same as wait, but gives up after timeout. Returns whether ready.
+	template<typename F>
+	bool wait_for(F ready, std::chrono::milliseconds timeout) {
+		for (unsigned i = 0; i < spin_iters; i++) {
+			if (ready())
+				return true;
+			cpu_relax();
+		}
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		waiters++;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		bool ret = condvar.wait_for(lock, timeout, ready);
+		waiters--;
+		return ret;
+	}
+
+	// Must be called after making the condition true
+	void notify_one() {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waiters.load(std::memory_order_relaxed)) {
+			{ std::lock_guard<std::mutex> lock(mutex_); }
+			condvar.notify_one();
+		}
+	}
+
+	void notify_all() {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		{ std::lock_guard<std::mutex> lock(mutex_); }
+		condvar.notify_all();
+	}
+
+private:
+	static constexpr unsigned spin_iters = 2000;
+	std::mutex mutex_;
+	std::condition_variable condvar;
+	std::atomic<unsigned> waiters{0};
+};
+
+// Bounded lock-free queue (Vyukov style ring buffer). Each cell carries a
+// sequence number that tells producers and consumers whether it is ready
+// to be written or read for the current lap.
+template<typename T>
+class RingQueue : public WorkQueue<T> {
+public:
+	// Capacity is rounded up to a power of two
+	RingQueue(size_t capacity) {
+		size_t sz = 2;
+		while (sz < capacity)
+			sz <<= 1;
+		mask = sz - 1;
+		cells.reset(new cell_t[sz]);
+		for (size_t i = 0; i < sz; i++)
+			cells[i].seq.store(i, std::memory_order_relaxed);
+	}
+
+	bool try_push(T &item) {
+		size_t pos = tail.load(std::memory_order_relaxed);
+		while (1) {
+			cell_t *c = &cells[pos & mask];
+			size_t seq = c->seq.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0) {
+				if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					c->data = std::move(item);
+					c->seq.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0)
+				return false;    // Full
+			else
+				pos = tail.load(std::memory_order_relaxed);
+		}
+	}
+
+	bool try_pop(T *item) {
+		size_t pos = head.load(std::memory_order_relaxed);
+		while (1) {
+			cell_t *c = &cells[pos & mask];
+			size_t seq = c->seq.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+			if (diff == 0) {
+				if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					*item = std::move(c->data);
+					c->seq.store(pos + mask + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0)
+				return false;    // Empty
+			else
+				pos = head.load(std::memory_order_relaxed);
+		}
+	}
+
+	void close() override {
+		nowriter = true;
+		notempty.notify_all();
+		notfull.notify_all();
+	}
+
+	void push(T item) override {
+		if (try_push(item)) {
+			notempty.notify_one();
+			return;
+		}
+		bool done = false;
+		notfull.wait([&] { return nowriter || (done = try_push(item)); });
+		if (done)
+			notempty.notify_one();
+	}
+
+	bool offer(T &item) override {
+		if (!try_push(item))
+			return false;
+		notempty.notify_one();
+		return true;
+	}
+
+	bool pop(T *item) noexcept override {
+		bool done = false;
+		// Whatever was taken must be handed out, even if closed meanwhile
+		notempty.wait([&] { return (done = try_pop(item)) || nowriter; });
+		if (!done)
+			return false;
+		notfull.notify_one();
+		return true;
+	}
+
+	// Same as pop, but also returns false if nothing came up within timeout
+	bool pop(T *item, std::chrono::milliseconds timeout) noexcept {
+		bool done = false;
+		notempty.wait_for([&] { return (done = try_pop(item)) || nowriter; }, timeout);
+		if (!done)
+			return false;
+		notfull.notify_one();
+		return true;
+	}
+
+private:
+	struct alignas(64) cell_t {
+		std::atomic<size_t> seq;
+		T data;
+	};
+
+	std::unique_ptr<cell_t[]> cells;
+	size_t mask;
+	alignas(64) std::atomic<size_t> head{0};   // Next cell to read
+	alignas(64) std::atomic<size_t> tail{0};   // Next cell to write
+	alignas(64) std::atomic<bool> nowriter{false};
+	Parker notempty, notfull;
+};
+
+// Two bounded lanes with priority for the first one: consumers take items
+// from it first, but after LANE_BURST consecutive ones they take one from
+// the second lane (if it has any) so that it doesn't starve. Producers
+// pick the lane and get told when it's full (see try_push()).
+#define LANE_BURST   8
+
+template<typename T>
+class LaneQueue : public WorkQueue<T> {
+public:
+	LaneQueue(size_t hicap, size_t locap) : hi(hicap), lo(locap) {}
+
+	// Queues an item in a lane (0 is the priority one), false if it is full
+	bool try_push(T &item, unsigned lane) {
+		if (!(lane ? lo : hi).try_push(item))
+			return false;
+		notempty.notify_one();
+		return true;
+	}
+
+	void close() override {
+		nowriter = true;
+		notempty.notify_all();
+		notfull.notify_all();
+	}
+
+	// Queues in the second lane, waits for room if it is full
+	void push(T item) override {
+		if (try_push(item, 1))
+			return;
+		bool done = false;
+		notfull.wait([&] { return nowriter || (done = lo.try_push(item)); });
+		if (done)
+			notempty.notify_one();
+	}
+
+	bool offer(T &item) override {
+		return try_push(item, 1);
+	}
+
+	bool pop(T *item) noexcept override {
+		bool done = false;
+		// Whatever was taken must be handed out, even if closed meanwhile
+		notempty.wait([&] { return (done = take(item)) || nowriter; });
+		if (!done)
+			return false;
+		notfull.notify_one();
+		return true;
+	}
+
+private:
+	bool take(T *item) {
+		if (streak.load(std::memory_order_relaxed) >= LANE_BURST && lo.try_pop(item)) {
+			streak.store(0, std::memory_order_relaxed);
+			return true;
+		}
+		if (hi.try_pop(item)) {
+			streak.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+		if (lo.try_pop(item)) {
+			streak.store(0, std::memory_order_relaxed);
+			return true;
+		}
+		return false;
+	}
+
+	RingQueue<T> hi, lo;
+	alignas(64) std::atomic<unsigned> streak{0};   // Items taken in a row from the first lane
+	std::atomic<bool> nowriter{false};
+	Parker notempty, notfull;
+};
+
+// Limits how many workers take requests: workers with an id at or above
+// the active count wait here until it grows (or the gate is closed). Checking
+// is a single relaxed load while a worker is within the count.
+class WorkerGate {
+public:
+	WorkerGate(unsigned active) : active(active) {}
+
+	// Waits until worker id may run, returns false once closed
+	bool pass(unsigned id) {
+		if (id < active.load(std::memory_order_relaxed))
+			return !closed.load(std::memory_order_relaxed);
+		std::unique_lock<std::mutex> lock(mutex_);
+		while (id >= active.load(std::memory_order_relaxed) && !closed)
+			condvar.wait(lock);
+		return !closed;
+	}
+
+	unsigned count() const { return active.load(std::memory_order_relaxed); }
+
+	void set(unsigned n) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		active.store(n, std::memory_order_relaxed);
+		condvar.notify_all();
+	}
+
+	void close() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		closed = true;
+		condvar.notify_all();
+	}
+
+private:
+	std::atomic<unsigned> active;
+	std::atomic<bool> closed{false};
+	std::mutex mutex_;
+	std::condition_variable condvar;
+};
+
+// Fixed set of preallocated objects that are handed out and given back,
+// avoids allocating one object per request.
+template<typename T>
+class ObjectPool {
+public:
+	ObjectPool(size_t size) : objs(new T[size]()), freeq(size) {
+		for (size_t i = 0; i < size; i++) {
+			T *o = &objs[i];
+			freeq.push(o);
+		}
+	}
+
+	// Gets an object, blocks if none are available at the moment
+	T *acquire() {
+		T *ret = nullptr;
+		if (!freeq.pop(&ret))
+			return nullptr;
+		return ret;
+	}
+
+	// Same as acquire, but returns nullptr if none came up within timeout
+	T *acquire(std::chrono::milliseconds timeout) {
+		T *ret = nullptr;
+		if (!freeq.pop(&ret, timeout))
+			return nullptr;
+		return ret;
+	}
+
+	// Gets an object if there's one available right away (or nullptr)
+	T *try_acquire() {
+		T *ret = nullptr;
+		freeq.try_pop(&ret);
+		return ret;
+	}
+
+	// Returns an object to the pool
+	void release(T *o) {
+		freeq.push(o);
+	}
+
+	// Unblocks any waiters, used on shutdown
+	void close() {
+		freeq.close();
+	}
+
+private:
+	std::unique_ptr<T[]> objs;
+	RingQueue<T*> freeq;
+};
+
+#endif
 
@@ -1,48 +1,257 @@
 
+
 #ifndef __RATELIMITER__HH__
 #define __RATELIMITER__HH__
 
-#include <string>
-#include <unordered_map>
-#include <mutex>
-#include <shared_mutex>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "shm.h"
+
+// Token bucket rate limiter, one bucket per source (IP hash).
+// Buckets live in a fixed capacity open addressing table (split in shards)
+// so memory stays bounded regardless of how many sources we see: when the
+// probe window is full the fullest bucket is evicted (the one that limits
+// its source the least, a newcomer starts full anyway). Buckets refill lazily
+// from their last update timestamp, so no background thread is needed, and
+// all updates are lock-free CAS operations on the slot state. Slots are
+// claimed by marking their key busy, so that the key is only published once
+// the bucket state is in place.
+// The table can live in a named shared memory segment instead, so that every
+// process on the host shares the same buckets (the clock is system wide).
+
+#define RL_SHARDS        64
+#define RL_PROBE          8
+#define RL_MAX_HPS    16000   // Tokens are stored as 24 bit milli-tokens
+#define RL_SHM_MAGIC  0x524cULL
+#define RL_BUSY       (~0ULL) // Key of a slot being claimed
+#define RL_BUSY_SPIN   1000
+#define RL_RETRIES       64   // Probes before giving up on a bucket
 
 class RateLimiter {
 private:
-	std::unordered_map<uint64_t, uint32_t> limiters;
-	mutable std::shared_mutex m;  // Mutex for hashmap updates
-	uint32_t hits_per_second;
-	std::thread refiller;
-	volatile bool end;
+	// Bucket state: milli-tokens (24 bits) | timestamp in ms (40 bits)
+	static constexpr uint64_t ts_mask = (1ULL << 40) - 1;
 
-public:
-	// Checks whether we hit the limit
-	bool check(uint64_t iphash) const {
-		std::shared_lock lock(m);
-		return (limiters.count(iphash) && limiters.at(iphash) > hits_per_second);
-	}
-	// Accounts one access to the given access ID
-	void consume(uint64_t iphash) {
-		std::unique_lock lock(m);
-		limiters[iphash]++;
-	}
-
-	RateLimiter(unsigned maxhps)
-	 : hits_per_second(maxhps), end(false) {
-		refiller = std::thread([this] {
-			while (!this->end) {
-				sleep(1);
-				if (!this->end) {
-					std::unique_lock lock(m);
-					this->limiters.clear();
+	struct slot_t {
+		std::atomic<uint64_t> key;     // Mixed source hash (0 means free)
+		std::atomic<uint64_t> state;   // Packed bucket state
+	};
+
+	// Shared memory segment header, the parameters the table was set up
+	// with: magic (16 bits) | log2 shard slots (8 bits) | hits per second
+	struct shm_hdr_t {
+		alignas(64) std::atomic<uint64_t> params;
+	};
+
+	slot_t *slots = nullptr;
+	std::unique_ptr<slot_t[]> owned;   // Unless in shared memory
+	void *shm = nullptr;
+	size_t shmsize = 0;
+	unsigned shard_slots;              // Slots per shard (power of two)
+	uint32_t hits_per_second;          // Bucket refill rate (and size)
+
+	static uint64_t mix(uint64_t x) {
+		x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+		x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+		x ^= x >> 31;
+		return x && x != RL_BUSY ? x : 1;
+	}
+
+	static uint64_t now_ms() {
+		return std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count() & ts_mask;
+	}
+
+	static uint64_t pack(uint64_t mtokens, uint64_t ts) {
+		return (mtokens << 40) | (ts & ts_mask);
+	}
+
+	uint64_t capacity() const {
+		return hits_per_second * 1000ULL;
+	}
+
+	// Tokens a bucket would have now
+	uint64_t tokens(uint64_t st, uint64_t now) const {
+		uint64_t elapsed = (now - st) & ts_mask;
+		if (elapsed > ts_mask / 2)
+			elapsed = 0;   // Updated by someone with a newer timestamp
+		return std::min(capacity(), (st >> 40) + elapsed * hits_per_second);
+	}
+
+	// Finds the bucket for a source key, claiming one (full) if it's not
+	// there. Probes again when it loses a race for a slot, but only so many
+	// times: slots left busy by a process that died mid-claim never settle,
+	// so it returns nullptr if the whole probe window looks like that.
+	slot_t *bucket(uint64_t k, uint64_t now) {
+		for (unsigned i = 0; i < RL_RETRIES; i++) {
+			if (slot_t *s = probe(k, now))
+				return s;
+		}
+		return nullptr;
+	}
+
+	// Key of a slot, waiting for a claim in progress to finish. Might still
+	// be RL_BUSY if it takes too long (ie. its claimer died).
+	static uint64_t settled_key(slot_t *c) {
+		uint64_t ck = c->key.load(std::memory_order_acquire);
+		for (unsigned i = 0; ck == RL_BUSY && i < RL_BUSY_SPIN; i++) {
+			cpu_relax();
+			ck = c->key.load(std::memory_order_acquire);
+		}
+		return ck;
+	}
+
+	// Takes over a slot (whose key is expected) for key k with a full bucket.
+	// Readers only match k once the state is in place.
+	bool claim(slot_t *c, uint64_t expected, uint64_t k, uint64_t now) {
+		if (!c->key.compare_exchange_strong(expected, RL_BUSY, std::memory_order_acq_rel))
+			return false;
+		c->state.store(pack(capacity(), now), std::memory_order_relaxed);
+		c->key.store(k, std::memory_order_release);
+		return true;
+	}
+
+	slot_t *probe(uint64_t k, uint64_t now) {
+		slot_t *shard = &slots[((k >> 48) % RL_SHARDS) * shard_slots];
+		unsigned pos = k & (shard_slots - 1);
+
+		// Find our bucket in the probe window, or claim a free one
+		slot_t *victim = nullptr;
+		uint64_t victim_tokens = 0;
+		for (unsigned i = 0; i < RL_PROBE; i++) {
+			slot_t *c = &shard[(pos + i) & (shard_slots - 1)];
+			uint64_t ck = settled_key(c);
+			if (ck == k)
+				return c;
+			else if (!ck)
+				return claim(c, 0, k, now) ? c : nullptr;
+			else if (ck != RL_BUSY) {
+				// Denied sources don't refresh their timestamp, so that's
+				// no measure of activity: go by tokens instead
+				uint64_t t = tokens(c->state.load(std::memory_order_relaxed), now);
+				if (!victim || t > victim_tokens) {
+					victim = c;
+					victim_tokens = t;
 				}
 			}
-		});
+		}
+
+		// Table region is full, evict the fullest bucket
+		if (!victim)
+			return nullptr;
+		uint64_t vk = victim->key.load(std::memory_order_acquire);
+		if (vk == k)
+			return victim;   // Someone else claimed it for us
+		if (vk == RL_BUSY || !claim(victim, vk, k, now))
+			return nullptr;
+		return victim;
+	}
+
+	// Refills the bucket according to the elapsed time and takes cost
+	// milli-tokens. Fails if there are not enough, unless partial is set
+	// (then it takes whatever is left).
+	bool take(slot_t *s, uint64_t cost, uint64_t now, bool partial) {
+		uint64_t st = s->state.load(std::memory_order_acquire);
+		while (1) {
+			uint64_t mtokens = tokens(st, now);
+			if (mtokens < cost && !partial)
+				return false;
+			uint64_t left = mtokens - std::min(mtokens, cost);
+			if (s->state.compare_exchange_weak(st, pack(left, now), std::memory_order_acq_rel))
+				return true;
+		}
+	}
+
+	static unsigned shard_size(unsigned nslots) {
+		unsigned ret = RL_PROBE;
+		while (ret * RL_SHARDS < nslots)
+			ret <<= 1;
+		return ret;
+	}
+
+public:
+	RateLimiter(unsigned maxhps, unsigned nslots = 65536)
+	 : shard_slots(shard_size(nslots)),
+	   hits_per_second(std::max(1U, std::min(maxhps, (unsigned)RL_MAX_HPS))) {
+		owned.reset(new slot_t[shard_slots * RL_SHARDS]);
+		slots = owned.get();
+		for (unsigned i = 0; i < shard_slots * RL_SHARDS; i++) {
+			slots[i].key.store(0, std::memory_order_relaxed);
+			slots[i].state.store(0, std::memory_order_relaxed);
+		}
+	}
+
+	// Uses (or creates) the shared memory segment shmname, all its users must
+	// agree on the parameters. Check valid() before using it.
+	RateLimiter(unsigned maxhps, unsigned nslots, const char *shmname)
+	 : shard_slots(shard_size(nslots)),
+	   hits_per_second(std::max(1U, std::min(maxhps, (unsigned)RL_MAX_HPS))) {
+		int fd = shm_open(shmname, O_RDWR | O_CREAT, 0600);
+		if (fd < 0)
+			return;
+		// A new segment is all zeros, which are free slots already
+		size_t size = sizeof(shm_hdr_t) + sizeof(slot_t) * shard_slots * RL_SHARDS;
+		struct stat st;
+		if (fstat(fd, &st) || ((size_t)st.st_size < size && ftruncate(fd, size))) {
+			close(fd);
+			return;
+		}
+		void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED)
+			return;
+		shm = p;
+		shmsize = size;
+
+		uint64_t params = (RL_SHM_MAGIC << 48) | ((uint64_t)__builtin_ctz(shard_slots) << 40) | hits_per_second;
+		uint64_t cur = 0;
+		shm_hdr_t *hdr = (shm_hdr_t*)shm;
+		if (hdr->params.compare_exchange_strong(cur, params) || cur == params)
+			slots = (slot_t*)(hdr + 1);
+	}
+
+	// Keeps the table in a shared memory arena (which must have arena_size() room)
+	RateLimiter(unsigned maxhps, unsigned nslots, ShmArena *arena)
+	 : shard_slots(shard_size(nslots)),
+	   hits_per_second(std::max(1U, std::min(maxhps, (unsigned)RL_MAX_HPS))) {
+		slots = arena->alloc<slot_t>(shard_slots * RL_SHARDS);
+	}
+
+	static size_t arena_size(unsigned nslots) {
+		return ShmArena::need<slot_t>(shard_size(nslots) * RL_SHARDS);
 	}
 
 	~RateLimiter() {
-		end = true;
-		refiller.join();
+		if (shm)
+			munmap(shm, shmsize);
+	}
+
+	bool valid() const { return slots != nullptr; }
+
+	// Accounts one access for the given source, returns false if it
+	// exceeded its rate (and thus should be blocked). Fails open if there's
+	// no bucket to be had for it (see bucket).
+	bool allow(uint64_t iphash) {
+		uint64_t now = now_ms();
+		slot_t *s = bucket(mix(iphash), now);
+		return !s || take(s, 1000, now, false);
+	}
+
+	// Accounts accesses that happened somewhere else (ie. other nodes),
+	// they use up the budget of the source but are never refused.
+	void charge(uint64_t iphash, unsigned hits) {
+		uint64_t now = now_ms();
+		if (slot_t *s = bucket(mix(iphash), now))
+			take(s, std::min((uint64_t)hits, (uint64_t)RL_MAX_HPS) * 1000, now, true);
 	}
 };
 
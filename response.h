@@ -0,0 +1,65 @@
+
+#ifndef __RESPONSE__HH__
+#define __RESPONSE__HH__
+
+#include <string>
+#include <string_view>
+#include <charconv>
+#include <fcgiapp.h>
+
+#define RESP_MAX_PARTS    8
+
+// A response made of a few parts that are written out as they are (no
+// concatenation or iostreams involved). Parts are either views of data
+// that outlives the response (static responses, request buffers) or
+// strings owned by the response itself.
+class Response {
+public:
+	Response() {}
+	Response(const Response&) = delete;
+	Response& operator=(const Response&) = delete;
+
+	// Appends data that must outlive the response
+	void add(std::string_view s) {
+		parts[nparts++] = s;
+	}
+
+	// Appends data owned by the response
+	void own(std::string s) {
+		owned[nowned] = std::move(s);
+		add(owned[nowned++]);
+	}
+
+	size_t size() const {
+		size_t ret = 0;
+		for (unsigned i = 0; i < nparts; i++)
+			ret += parts[i].size();
+		return ret;
+	}
+
+	// HTTP status code, from the Status header (always the first thing sent)
+	unsigned status() const {
+		unsigned ret = 0;
+		if (nparts && parts[0].substr(0, 8) == "Status: ")
+			std::from_chars(parts[0].data() + 8, parts[0].data() + parts[0].size(), ret);
+		return ret;
+	}
+
+	const std::string_view *begin() const { return &parts[0]; }
+	const std::string_view *end() const { return &parts[nparts]; }
+
+	// Writes the response to the FastCGI output stream
+	void write(FCGX_Stream *out) const {
+		for (unsigned i = 0; i < nparts; i++)
+			FCGX_PutStr(parts[i].data(), parts[i].size(), out);
+	}
+
+private:
+	std::string_view parts[RESP_MAX_PARTS];
+	unsigned nparts = 0;
+	std::string owned[RESP_MAX_PARTS];
+	unsigned nowned = 0;
+};
+
+#endif
+
@@ -0,0 +1,250 @@
+
+#ifndef __REVOKE__HH__
+#define __REVOKE__HH__
+
+#include <string>
+#include <string_view>
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+// Server side session revocation, kept in a small memory mapped file so it
+// survives restarts (and is shared by every process mapping it, including
+// the command line revoke tool).
+//  - Per user "not before" timestamps: cookies issued at or before it are
+//    no longer valid. Every user gets a slot at config load time and its
+//    credential points straight at it, so checking costs one load.
+//  - Individual sessions go into a bloom filter, keyed on the decoded cookie
+//    (see CookieAuth::session_id_t) so that re-encoded copies of a revoked
+//    cookie stay revoked too. There are two filters, the current one gets
+//    the new tokens and when it's older than the longest session duration
+//    the other one (whose tokens expired already) is cleared and takes its
+//    place.
+// Readers never lock, writers (which are rare) serialize on a file lock.
+
+#define REV_MAGIC       0x31564552504f5426ULL
+#define REV_HASHES      4
+
+class RevocationList {
+public:
+	// Opens (or creates, with room for nusers users and nbits bits per
+	// filter) the file. An existing file keeps its own parameters.
+	RevocationList(const char *path, unsigned nusers, uint64_t nbits) {
+		fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+		if (fd < 0)
+			return;
+		flock(fd, LOCK_EX);
+		map(nusers, nbits);
+		unlock();
+	}
+
+	~RevocationList() {
+		if (base)
+			munmap(base, size);
+		if (fd >= 0)
+			close(fd);
+	}
+
+	bool valid() const { return base != nullptr; }
+
+	// Bumped on every per user revocation (cached verifications are tagged
+	// with it, so they don't outlive one)
+	uint32_t serial() const {
+		return hdr->serial.load(std::memory_order_acquire);
+	}
+
+	// Filters must be rotated at least this often (seconds), so tokens only
+	// go away once expired. It's the longest session duration.
+	void set_period(int64_t period) {
+		hdr->period.store(period, std::memory_order_relaxed);
+	}
+
+	// Not before timestamp of a user (nullptr if there's no room for it)
+	std::atomic<int64_t> *user(std::string_view host, std::string_view username) {
+		uint64_t k = hash64(host, hash64(username)) | 1;
+		for (unsigned i = 0; i < hdr->users; i++) {
+			user_t *u = &users[(k + i) % hdr->users];
+			uint64_t uk = u->key.load(std::memory_order_acquire);
+			if (!uk && u->key.compare_exchange_strong(uk, k, std::memory_order_acq_rel))
+				return &u->notbefore;
+			if (uk == k)
+				return &u->notbefore;
+		}
+		return nullptr;
+	}
+
+	// Invalidates all the cookies of a user issued up to now
+	void revoke_user(std::atomic<int64_t> *notbefore) {
+		notbefore->store(time(0), std::memory_order_release);
+		hdr->serial.fetch_add(1, std::memory_order_acq_rel);
+		msync(base, size, MS_ASYNC);
+	}
+
+	void revoke_token(std::string_view token) {
+		uint64_t h = hash64(token);
+		time_t now = time(0);
+		flock(fd, LOCK_EX);
+		rotate(now);
+		unsigned cur = hdr->cur.load(std::memory_order_relaxed);
+		std::atomic<uint64_t> *f = filter(cur);
+		for (unsigned i = 0; i < REV_HASHES; i++) {
+			uint64_t b = bit(h, i);
+			f[b >> 6].fetch_or(1ULL << (b & 63), std::memory_order_release);
+		}
+		hdr->count[cur].fetch_add(1, std::memory_order_release);
+		msync(base, size, MS_ASYNC);
+		unlock();
+	}
+
+	// Whether any token is revoked at all (nothing to look at most of the time)
+	bool any_tokens() const {
+		return hdr->count[0].load(std::memory_order_acquire) || hdr->count[1].load(std::memory_order_acquire);
+	}
+
+	bool token_revoked(std::string_view token) const {
+		if (!any_tokens())
+			return false;
+		uint64_t h = hash64(token);
+		for (unsigned g = 0; g < 2; g++) {
+			if (!hdr->count[g].load(std::memory_order_acquire))
+				continue;
+			const std::atomic<uint64_t> *f = filter(g);
+			unsigned i = 0;
+			for (; i < REV_HASHES; i++) {
+				uint64_t b = bit(h, i);
+				if (!(f[b >> 6].load(std::memory_order_relaxed) & (1ULL << (b & 63))))
+					break;
+			}
+			if (i == REV_HASHES)
+				return true;
+		}
+		return false;
+	}
+
+private:
+	struct hdr_t {
+		uint64_t magic = 0;
+		uint32_t users = 0;
+		uint32_t pad = 0;
+		uint64_t bits = 0;                     // Per filter, power of two
+		std::atomic<uint32_t> serial{0};
+		std::atomic<uint32_t> cur{0};          // Filter taking new tokens
+		std::atomic<uint32_t> count[2] = {};   // Tokens in each filter
+		std::atomic<int64_t> started[2] = {};  // When each became current
+		std::atomic<int64_t> period{0};
+		char reserved[8];
+	};
+
+	struct user_t {
+		std::atomic<uint64_t> key;          // Host and user hash (0 is free)
+		std::atomic<int64_t> notbefore;
+	};
+
+	static size_t layout(uint64_t nusers, uint64_t bits) {
+		return sizeof(hdr_t) + sizeof(user_t) * nusers + 2 * bits / 8;
+	}
+
+	// Simple 8 bytes at a time hash, stable across builds (it's persisted)
+	static uint64_t hash64(std::string_view s, uint64_t h = 0xcbf29ce484222325ULL) {
+		h ^= s.size() * 0x9e3779b97f4a7c15ULL;
+		size_t i = 0;
+		for (; i + 8 <= s.size(); i += 8) {
+			uint64_t w;
+			memcpy(&w, &s[i], 8);
+			h = (h ^ (w * 0xff51afd7ed558ccdULL)) * 0x100000001b3ULL;
+			h ^= h >> 29;
+		}
+		for (; i < s.size(); i++)
+			h = (h ^ (unsigned char)s[i]) * 0x100000001b3ULL;
+		h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+		return h ^ (h >> 33);
+	}
+
+	uint64_t bit(uint64_t h, unsigned i) const {
+		return (h + i * ((h >> 32) | 1)) & (hdr->bits - 1);
+	}
+
+	std::atomic<uint64_t> *filter(unsigned g) const {
+		return &words[g * (hdr->bits / 64)];
+	}
+
+	// Swaps filters while the current one is older than a period (with the
+	// file lock held), clearing the one that becomes current
+	void rotate(time_t now) {
+		int64_t period = hdr->period.load(std::memory_order_relaxed);
+		for (unsigned r = 0; r < 2 && period > 0; r++) {
+			unsigned cur = hdr->cur.load(std::memory_order_relaxed);
+			if (now - hdr->started[cur].load(std::memory_order_relaxed) < period)
+				return;
+			unsigned next = cur ^ 1;
+			hdr->count[next].store(0, std::memory_order_release);
+			std::atomic<uint64_t> *f = filter(next);
+			for (uint64_t i = 0; i < hdr->bits / 64; i++)
+				f[i].store(0, std::memory_order_relaxed);
+			hdr->started[next].store(now, std::memory_order_relaxed);
+			hdr->cur.store(next, std::memory_order_release);
+		}
+	}
+
+	// Maps the file (with the lock held), setting it up if it's new. The magic
+	// is written last, so a file without it (ie. the process creating it
+	// crashed right after sizing it) is set up again.
+	void map(unsigned nusers, uint64_t nbits) {
+		struct stat st;
+		if (fstat(fd, &st))
+			return;
+
+		hdr_t h;
+		bool fresh = !st.st_size ||
+		             ((size_t)st.st_size >= sizeof(h) && pread(fd, (void*)&h, sizeof(h), 0) == sizeof(h) && !h.magic);
+		if (fresh) {
+			uint64_t bits = 64;
+			while (bits < nbits)
+				bits <<= 1;
+			size = layout(nusers, bits);
+			if (ftruncate(fd, size))
+				return;
+			h.users = nusers;
+			h.bits = bits;
+		}
+		else if (pread(fd, (void*)&h, sizeof(h), 0) != sizeof(h) || h.magic != REV_MAGIC ||
+		         (size = layout(h.users, h.bits)) != (size_t)st.st_size)
+			return;
+
+		void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED)
+			return;
+		base = (char*)p;
+		hdr = (hdr_t*)base;
+		if (fresh) {
+			hdr->users = h.users;
+			hdr->bits = h.bits;
+			hdr->started[0] = time(0);
+			msync(base, size, MS_SYNC);
+			hdr->magic = REV_MAGIC;
+			msync(base, size, MS_SYNC);
+		}
+		users = (user_t*)(base + sizeof(hdr_t));
+		words = (std::atomic<uint64_t>*)(base + sizeof(hdr_t) + sizeof(user_t) * hdr->users);
+	}
+
+	void unlock() {
+		flock(fd, LOCK_UN);
+	}
+
+	int fd = -1;
+	char *base = nullptr;
+	size_t size = 0;
+	hdr_t *hdr = nullptr;
+	user_t *users = nullptr;
+	std::atomic<uint64_t> *words = nullptr;
+};
+
+#endif
+
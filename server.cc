@@ -18,51 +18,77 @@
 #include <cmath>
 #include <unordered_map>
 #include <fstream>
-#include <fcgio.h>
+#include <iostream>
+#include <fcgiapp.h>
 #include <unistd.h>
 #include <signal.h>
 #include <libconfig.h>
-#include <list>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
 
 #include "templates.h"
 #include "queue.h"
 #include "util.h"
+#include "hmac.h"
 #include "ratelimit.h"
+#include "cookiecache.h"
 #include "logger.h"
+#include "auditlog.h"
+#include "response.h"
+#include "auth.h"
+#include "metrics.h"
+#include "flatmap.h"
+#include "password.h"
+#include "fcgiloop.h"
+#include "keepalive.h"
+#include "cluster.h"
+#include "shm.h"
+#include "confimage.h"
+#include "autoscale.h"
 
-#define TOTP_DEF_DIGITS         6
-#define TOTP_DEF_PERIOD        30
-#define TOTP_DEF_GENS           1      // Allows a window of 90s by default
-#define TOTP_DEF_ALGO      "sha1"
-
-enum htAlgo {
-	hAlgoSha1    = 0,
-	hAlgoSha256  = 1,
-	hAlgoSha512  = 2
-};
-
-const std::unordered_map<std::string, htAlgo> algnames = {
-	{"sha1",    hAlgoSha1},
-	{"sha-256", hAlgoSha256},
-	{"sha-512", hAlgoSha512},
-};
 
 // Use some reasonable default.
 int nthreads = 4;
 
 #define MAX_REQ_SIZE    (4*1024)
+#define LISTEN_BACKLOG  1024
 #define RET_ERR(x) { std::cerr << x << std::endl; return 1; }
 
-typedef std::unordered_map<std::string, std::string> StrMap;
-
-struct cred_t {
-	std::string password, totp;  // Pass and TOTP (binary)
-	unsigned sduration;          // Duration of a valid session (seconds)
-	unsigned digits;             // Digits of TOTP
-	unsigned period;             // Period of TOTP
-	htAlgo algorithm;            // TOTP hashing algorithm
+// Constant responses, sent as they are
+static const std::string_view resp_auth_ok =
+	"Status: 200\r\nContent-Type: text/plain\r\n"
+	"Content-Length: 24\r\n\r\nAuthentication Succeeded";
+static const std::string_view resp_auth_denied =
+	"Status: 401\r\nContent-Type: text/plain\r\n"
+	"Content-Length: 21\r\n\r\nAuthentication Denied";
+static const std::string_view resp_ratelimited =
+	"Status: 429\r\nContent-Type: text/plain\r\n"
+	"Content-Length: 34\r\n\r\nToo many requests, request blocked";
+static const std::string_view resp_notemplate =
+	"Status: 500\r\nContent-Type: text/plain\r\n"
+	"Content-Length: 23\r\n\r\nCould not find template";
+static const std::string_view resp_logout =
+	"Status: 302\r\nSet-Cookie: authentication-token=null\r\n"
+	"Cache-Control: no-cache, no-store, max-age=0\r\n"
+	"Location: /login\r\n\r\n";
+static const std::string_view resp_busy =
+	"Status: 503\r\nContent-Type: text/plain\r\nRetry-After: 1\r\n"
+	"Content-Length: 33\r\n\r\nServer busy, please retry shortly";
+static const std::string_view resp_notfound =
+	"Status: 404\r\nContent-Type: text/plain\r\n"
+	"Content-Length: 48\r\n\r\nNot found, valid endpoints: /auth /login /logout";
+
+
+// Login page with everything but the follow_page rendered already,
+// which needs to be spliced in between the chunks.
+struct login_page_t {
+	std::vector<std::string> chunks;  // Static text around follow_page slots
+	size_t length = 0;                // Static text length (all chunks)
 };
 
 struct web_t {
@@ -70,156 +96,303 @@ struct web_t {
 	unsigned totp_generations;    // 0 means only current code is valid,
 	                              // 1 means previous and next code is also valid
 	                              // 2 means the 2 previous and next codes are also valid, etc
-	std::unordered_map<std::string, cred_t> users;  // User to credential
+	users_t users;                // User to credential
+	PasswordHash decoy;           // Verified for unknown users (like the first hashed one)
+	bool has_page;                // Whether the template exists
+	login_page_t login_page[2];   // Login page, without and with error message
+	unsigned hostid;              // Index in the metrics host list
 };
 
-std::unordered_map<std::string, web_t> webcfg;   // Hostname -> Config
+static login_page_t prerender_page(const t_template &tmpl, const std::string &hostname, bool err) {
+	login_page_t ret;
+	ret.chunks.emplace_back();
+	for (const auto & seg : tmpl) {
+		if (seg.type == segStatic || (seg.type == segLoginFailed && err))
+			ret.chunks.back().append(seg.data, seg.len);
+		else if (seg.type == segHostname)
+			ret.chunks.back() += hostname;
+		else if (seg.type == segFollowPage)
+			ret.chunks.emplace_back();
+	}
+	for (const auto & c : ret.chunks)
+		ret.length += c.size();
+	return ret;
+}
 
+// Produces the full response (headers included) for a login page
+static std::string render_page(const login_page_t &page, std::string_view follow_page) {
+	static const char hdr[] = "Status: 200\r\nContent-Type: text/html\r\nContent-Length: ";
+	size_t blen = page.length + (page.chunks.size() - 1) * follow_page.size();
+	char lenstr[24];
+	int lenlen = snprintf(lenstr, sizeof(lenstr), "%zu\r\n\r\n", blen);
+
+	std::string ret;
+	ret.reserve(sizeof(hdr) - 1 + lenlen + blen);
+	ret.append(hdr, sizeof(hdr) - 1);
+	ret.append(lenstr, lenlen);
+	for (unsigned i = 0; i < page.chunks.size(); i++) {
+		if (i)
+			ret += follow_page;
+		ret += page.chunks[i];
+	}
+	return ret;
+}
+
+// Immutable snapshot of the webs config. Reloads publish a new one, workers
+// keep a reference to theirs and only pick up a new one (which involves a
+// lock inside atomic_load) when they see the generation change.
+struct webcfg_t {
+	FlatMap<web_t> webs;                           // Hostname -> Config
+	std::vector<std::string> hostnames;            // By host id
+	uint32_t generation;
+};
+
+std::shared_ptr<const webcfg_t> webcfg;
+std::atomic<uint32_t> webcfg_gen{1};
+
+volatile bool serving = true;
+
+// FastCGI request along with the time it was accepted (for queue wait times),
+// either a libfcgi one or one read by an event loop (when async is set)
+struct queued_req_t {
+	FCGX_Request fcgx;
+	AsyncRequest *async;
+	uint64_t accepted;
+};
+
+// Finishes a libfcgi request and gives it back to the pool, unless nginx
+// wants to keep the connection and there's room to park it as idle.
+static void finish_req(queued_req_t *req, IdlePoller<queued_req_t> *idle, ObjectPool<queued_req_t> *pool) {
+	FCGX_Finish_r(&req->fcgx);
+	if (req->fcgx.ipcFd >= 0) {
+		if (idle && idle->park(req))
+			return;
+		FCGX_Free(&req->fcgx, 1);
+	}
+	pool->release(req);
+}
+
+// Views over the FastCGI request buffers, the variables and cookies
+// are only extracted (and decoded) when the endpoint needs them.
 struct web_req {
-	std::string method, host, uri;
-	StrMap getvars, postvars, cookies;
+	std::string_view method, host, uri;
+	std::string_view query, body, cookiejar;
 	uint64_t ip64;
+	uint8_t ip[16];     // IPv6 (IPv4 mapped)
+
+	std::string getvar(std::string_view name) const { return find_var(query, name); }
+	std::string postvar(std::string_view name) const { return find_var(body, name); }
+	std::string_view cookie(std::string_view name) const { return find_cookie(cookiejar, name); }
 };
 
 class AuthenticationServer {
 private:
-	// Secret 'random' string that is used to authenticate cookies
-	std::string cookie_secret;
-
 	// Thread to spawn
 	std::thread cthread;
 
-	// Shared queue
-	ConcurrentQueue<std::unique_ptr<FCGX_Request>> *rq;
+	// Shared queue and the pool requests are given back to
+	WorkQueue<queued_req_t*> *rq;
+	ObjectPool<queued_req_t> *rpool;
+
+	// Where kept alive connections wait for their next request (if any)
+	IdlePoller<queued_req_t> *idle;
 
-	// Rate limiter for auth attempts
+	// Listen socket, when accepting requests without the queue (or -1)
+	int lsock;
+
+	// Where the worker waits while not needed (adaptive pool), its id and
+	// the cpus workers run on (if set, round robin by id)
+	WorkerGate *gate;
+	unsigned id;
+	const std::vector<int> cpus;
+
+	// Requests that waited in the queue longer than this (ns, 0 means no
+	// limit) are answered with a 503 without processing them
+	uint64_t deadline;
+
+	// Rate limiters for auth attempts (per source and per user), and where
+	// allowed ones are shared (if any)
 	RateLimiter* const rl;
+	RateLimiter* const userrl;
+	GossipTable *cluster;
+
+	// Cookie issuing and validation, and revocation (if enabled)
+	CookieAuth cauth;
+	RevocationList *rev;
 
-	// Event logging
+	// Hashed password verification
+	VerifyPool *vpool;
+
+	// Event logging, as text or as request records (if audit is set)
 	Logger *logger;
+	AuditLog *audit;
+
+	// Counters and latency histograms
+	Metrics *metrics;
 
 	// Signal end of workers
 	bool end;
 
-	std::string create_cookie(std::string user) {
-		std::string payload = std::to_string(time(0)) + ":" + hexencode(user);
-		return payload + ":" + hexencode(hmac_sha1(this->cookie_secret, payload));
-	}
+	// Config snapshot in use
+	std::shared_ptr<const webcfg_t> cfg;
+	uint32_t cfg_gen = 0;
 
-	// Returns true if the cookie is good.
-	bool check_cookie(std::string cookie, const web_t *wcfg) {
-		// The cookie format is something like:
-		// etime:hex(user):hex(hmac)
-		auto p1 = cookie.find(':');
-		if (p1 == std::string::npos)
-			return false;
-		auto p2 = cookie.find(':', p1 + 1);
-		if (p2 == std::string::npos)
-			return false;
-		std::string c1 = cookie.substr(0, p1);
-		std::string user = hexdecode(cookie.substr(p1+1, p2-p1-1));
-		std::string hmac = hexdecode(cookie.substr(p2+1));
-		uint64_t ets = atol(c1.c_str());
-		// Lookup by username
-		if (!wcfg->users.count(user))
-			return false;
-		unsigned duration = wcfg->users.at(user).sduration;
-		// Not valid if the cookie is too old
-		if ((unsigned)time(0) > ets + duration)
-			return false;
-		// Finally check the HMAC with the secret to ensure the cookie is valid
-		std::string hmac_calc = hmac_sha1(this->cookie_secret, cookie.substr(0, p2));
-		return (hmac == hmac_calc);
-	}
-
-	std::string process_req(web_req *req, const web_t *wcfg) {
-		std::string rpage = req->getvars["follow_page"];
-		if (rpage.empty())
-			rpage = req->postvars["follow_page"];
-		if (rpage.empty())
-			rpage = "/";    // Make sure we never return empty location, default to index
 
+	void process_req(web_req *req, const web_t *wcfg, Response *resp, audit_event_t *ev) {
 		if (req->uri == "/auth") {
 			// Read cookie and validate the authorization
-			bool authed = check_cookie(req->cookies["authentication-token"], wcfg);
-			// logger->log("Requested auth with result: " + std::to_string(authed));
-			if (authed) {
-				logger->log("Requested authentication succeeded");
-				return "Status: 200\r\nContent-Type: text/plain\r\n"
-				       "Content-Length: 24\r\n\r\nAuthentication Succeeded";
-			}
-			else {
-				logger->log("Requested authentication denied");
-				return "Status: 401\r\nContent-Type: text/plain\r\n"
-				       "Content-Length: 21\r\n\r\nAuthentication Denied";
-			}
+			uint64_t start = mono_ns();
+			bool authed = cauth.check(req->cookie("authentication-token"), req->host, wcfg->users, cfg_gen);
+			metrics->stage(stCookie, mono_ns() - start);
+			ev->event = authed ? aeAuthOk : aeAuthDenied;
+			return resp->add(authed ? resp_auth_ok : resp_auth_denied);
 		}
 		else if (req->uri == "/login") {
 			// Die hard if someone's bruteforcing this
-			if (rl->check(req->ip64)) {
-				logger->log("Rate limit hit for ip id " + std::to_string(req->ip64));
-				return "Status: 429\r\nContent-Type: text/plain\r\n"
-				       "Content-Length: 34\r\n\r\nToo many requests, request blocked";
+			if (!rl->allow(req->ip64)) {
+				ev->event = aeRateLimited;
+				return resp->add(resp_ratelimited);
 			}
-			rl->consume(req->ip64);
+			if (cluster)
+				cluster->note(req->ip64);
+
+			std::string rpage = req->getvar("follow_page");
+			if (rpage.empty())
+				rpage = req->postvar("follow_page");
+			if (rpage.empty())
+				rpage = "/";    // Make sure we never return empty location, default to index
 
 			bool lerror = false;
 			if (req->method == "POST") {
-				std::string user = req->postvars["username"];
-				std::string pass = req->postvars["password"];
-				unsigned    totp = atoi(req->postvars["totp"].c_str());
+				std::string user = req->postvar("username");
+				std::string pass = req->postvar("password");
+				unsigned    totp = atoi(req->postvar("totp").c_str());
+
+				const cred_t *cred = wcfg->users.find(user);
+				ev->uid = cred ? cred->uid : ~0U;
+				ev->user = user;
+
+				// Attempts against an account (known or not, so this tells
+				// nothing) from many sources have a budget of their own, so
+				// that they can't keep the verify pool busy either.
+				std::string ukey(req->host);
+				ukey.push_back('\0');
+				ukey += user;
+				if (!userrl->allow(std::hash<std::string>{}(ukey))) {
+					ev->event = aeRateLimited;
+					return resp->add(resp_ratelimited);
+				}
 
-				// Validate the authentication to issue a cookie or throw an error
-				if (wcfg->users.count(user) &&
-				    wcfg->users.at(user).password == pass &&
-				    totp_valid(wcfg->users.at(user), totp, wcfg->totp_generations)) {
+				// Validate the authentication to issue a cookie or throw an error.
+				// Both factors are always checked, and unknown users verify a
+				// decoy password, so that the response time does not tell
+				// whether the user exists or the code alone was right.
+				uint64_t start = mono_ns();
+				bool totp_ok = cred && totp_valid(*cred, totp, wcfg->totp_generations);
+				metrics->stage(stTotp, mono_ns() - start);
+
+				start = mono_ns();
+				int ok = vpool->verify(cred ? cred->password : wcfg->decoy, pass);
+				metrics->stage(stPassword, mono_ns() - start);
+				if (ok < 0) {
+					ev->event = aeLoginBusy;
+					return resp->add(resp_busy);
+				}
+				bool valid = cred && totp_ok && ok;
 
-					logger->log("Login successful for user " + user);
+				if (valid) {
+					ev->event = aeLoginOk;
 
 					// Render a redirect page to the redirect address (+cookie)
-					std::string token = create_cookie(user);
-					return "Status: 302\r\nSet-Cookie: authentication-token=" + token +
-					       "\r\nLocation: " + stripnl(rpage) + "\r\n\r\n";
+					resp->add("Status: 302\r\nSet-Cookie: authentication-token=");
+					resp->own(cauth.create(user, *cred));
+					resp->add("\r\nLocation: ");
+					resp->own(stripnl(rpage));
+					return resp->add("\r\n\r\n");
 				}
 				else {
-					logger->log("Failed login for user " + user);
+					ev->event = aeLoginFailed;
 					lerror = true;   // Render login page with err message
 				}
 			}
 
 			// Just renders the login page
-			if (!templates.count(wcfg->webtemplate))
-				return "Status: 500\r\nContent-Type: text/plain\r\n"
-					   "Content-Length: 23\r\n\r\nCould not find template";
-			else {
-				std::string page = templates.at(wcfg->webtemplate)(req->host, rpage, lerror);
-				return "Status: 200\r\nContent-Type: text/html\r\n"
-					   "Content-Length: " + std::to_string(page.size()) + "\r\n\r\n" + page;
-			}
+			if (!wcfg->has_page)
+				return resp->add(resp_notemplate);
+
+			uint64_t start = mono_ns();
+			resp->own(render_page(wcfg->login_page[lerror], rpage));
+			return metrics->stage(stRender, mono_ns() - start);
 		}
 		else if (req->uri == "/logout") {
-			logger->log("Logout requested");
+			ev->event = aeLogout;
+			// Revoke the session server side, if it's valid. All of them with
+			// all=1, only when POSTed so that a cross-site link can't do it.
+			time_t expiry;
+			CookieAuth::session_id_t sid;
+			std::string_view token = req->cookie("authentication-token");
+			const cred_t *cred = !rev ? nullptr : cauth.owner(token, wcfg->users, time(0), &expiry, &sid);
+			if (cred) {
+				ev->uid = cred->uid;
+				rev->revoke_token(sid.view());
+				if (cred->notbefore && req->method == "POST" && req->postvar("all") == "1") {
+					rev->revoke_user(cred->notbefore);
+					ev->event = aeLogoutAll;
+				}
+			}
 			// Just redirect to the page (if present, otherwise login) deleting cookie
-			return "Status: 302\r\nSet-Cookie: authentication-token=null\r\n"
-				   "Cache-Control: no-cache, no-store, max-age=0\r\n"
-				   "Location: /login\r\n\r\n";
+			return resp->add(resp_logout);
+		}
+		ev->event = aeNotFound;
+		resp->add(resp_notfound);
+	}
+
+	// Logs what happened with a request, once it's done
+	void log_request(const web_req &req, const audit_event_t &ev, mEndpoint ep, unsigned status,
+	                 uint64_t latency) {
+		if (audit)
+			return audit->log(ev.event, ep, status, req.host, ev.user, req.ip, ev.uid, latency);
+
+		switch (ev.event) {
+		case aeAuthOk:
+			return logger->log("Requested authentication succeeded");
+		case aeAuthDenied:
+			return logger->log("Requested authentication denied");
+		case aeRateLimited:
+			return logger->log("Rate limit hit for ip id " + std::to_string(req.ip64));
+		case aeLoginOk:
+			return logger->log("Login successful for user " + ev.user);
+		case aeLoginFailed:
+			return logger->log("Failed login for user " + ev.user);
+		case aeLoginBusy:
+			return logger->log("Password verification busy, rejected login for user " + ev.user);
+		case aeLogoutAll:
+			logger->log("Logout requested");
+			return logger->log("Revoked all sessions of user id " + std::to_string(ev.uid));
+		case aeLogout:
+			return logger->log("Logout requested");
+		case aeUnknownHost:
+			return logger->log("Failed to find host '" + std::string(req.host) + "'");
+		case aeNotFound:
+			return logger->log("Unknown request for URL: " + std::string(req.uri));
+		default:
+			return;
 		}
-		logger->log("Unknown request for URL: " + req->uri);
-		return "Status: 404\r\nContent-Type: text/plain\r\n"
-			   "Content-Length: 48\r\nNot found, valid endpoints: /auth /login /logout\r\n\r\n";
 	}
 
 public:
-	AuthenticationServer(ConcurrentQueue<std::unique_ptr<FCGX_Request>> *rq,
-		std::string csecret, RateLimiter* const rl, Logger *logger)
-	: rq(rq), rl(rl), logger(logger), end(false)
+	AuthenticationServer(WorkQueue<queued_req_t*> *rq, ObjectPool<queued_req_t> *rpool,
+		IdlePoller<queued_req_t> *idle, int lsock, WorkerGate *gate, unsigned id, const std::vector<int> &cpus,
+		uint64_t deadline, const cookie_keys_t *ckeys, bool compact_cookies, RateLimiter* const rl,
+		RateLimiter* const userrl, GossipTable *cluster,
+		CookieCache* const cc, RevocationList *rev, VerifyPool *vpool, Logger *logger, AuditLog *audit,
+		Metrics *metrics)
+	: rq(rq), rpool(rpool), idle(idle), lsock(lsock), gate(gate), id(id), cpus(cpus), deadline(deadline), rl(rl), userrl(userrl), cluster(cluster),
+	  cauth(ckeys, cc, compact_cookies, rev), rev(rev), vpool(vpool),
+	  logger(logger), audit(audit), metrics(metrics),
+	  end(false)
 	{
-		// Use work() as thread entry point
-		cthread = std::thread(&AuthenticationServer::work, this);
-		if (csecret.empty())
-			this->cookie_secret = randstr();
-		else
-			this->cookie_secret = csecret;
+		cthread = std::thread(&AuthenticationServer::run, this);
 	}
 
 	~AuthenticationServer() {
@@ -227,145 +400,171 @@ public:
 		cthread.join();
 	}
 
-	bool totp_valid(cred_t user, unsigned input, unsigned generations) {
-		uint32_t ct = time(0) / user.period;
-		for (int i = -(signed)generations; i <= (signed)generations; i++)
-			if (totp_calc(user.totp, user.algorithm, user.digits, ct + i) == input)
-				return true;
-		return false;
+
+	// Produces the response for a request (its variables and body), accepted
+	// is the time it was accepted at and start the time processing started.
+	void process(char **envp, std::string_view body, uint64_t accepted, uint64_t start, Response *resp) {
+		if (accepted != start)
+			metrics->stage(stQueueWait, start - accepted);
+
+		// Find out basic info
+		web_req wreq;
+		wreq.method    = FCGX_GetParam("REQUEST_METHOD", envp) ?: "";
+		wreq.uri       = FCGX_GetParam("DOCUMENT_URI", envp) ?: "";
+		wreq.query     = FCGX_GetParam("QUERY_STRING", envp) ?: "";
+		wreq.body      = body;
+		wreq.host      = FCGX_GetParam("HTTP_HOST", envp) ?: "";
+		wreq.cookiejar = FCGX_GetParam("HTTP_COOKIE", envp) ?: "";
+
+		// Extract source IP
+		const char *sip = FCGX_GetParam("REMOTE_ADDR", envp) ?: "0.0.0.0";
+		struct in6_addr res6; struct in_addr res4;
+		memset(wreq.ip, 0, sizeof(wreq.ip));
+		if (inet_pton(AF_INET6, sip, &res6) == 1) {
+			wreq.ip64 = ((uint64_t)res6.s6_addr[0] << 40) | ((uint64_t)res6.s6_addr[1] << 32) |
+			            ((uint64_t)res6.s6_addr[2] << 24) | ((uint64_t)res6.s6_addr[3] << 16) |
+			            ((uint64_t)res6.s6_addr[4] <<  8) | ((uint64_t)res6.s6_addr[5]);
+			memcpy(wreq.ip, res6.s6_addr, sizeof(wreq.ip));
+		}
+		else if (inet_pton(AF_INET, sip, &res4) == 1) {
+			wreq.ip64 = res4.s_addr;
+			wreq.ip[10] = wreq.ip[11] = 0xff;
+			memcpy(&wreq.ip[12], &res4.s_addr, 4);
+		}
+		else
+			wreq.ip64 = 0;
+
+		// Pick up the latest config if it was reloaded
+		if (webcfg_gen.load(std::memory_order_acquire) != cfg_gen) {
+			cfg = std::atomic_load(&webcfg);
+			cfg_gen = cfg->generation;
+		}
+
+		// Lookup hostname for this request
+		const web_t *wptr = cfg->webs.find(wreq.host);
+		unsigned hostid = !wptr ? ~0U : wptr->hostid;
+		mEndpoint ep = metric_endpoint(wreq.uri);
+		metrics->stage(stParse, mono_ns() - start);
+
+		audit_event_t ev;
+		if (ep == epMetrics && metrics->exposed()) {
+			std::string body = metrics->render(logger->dropped() + (audit ? audit->dropped() : 0));
+			resp->own("Status: 200\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+			          std::to_string(body.size()) + "\r\n\r\n");
+			resp->own(std::move(body));
+		}
+		else if (!wptr) {
+			ev.event = aeUnknownHost;
+			resp->add("Status: 500\r\nContent-Type: text/plain\r\nContent-Length: ");
+			resp->own(std::to_string(wreq.host.size() + 18) + "\r\n\r\nUnknown hostname: ");
+			resp->add(wreq.host);
+		}
+		else
+			process_req(&wreq, wptr, resp, &ev);
+
+		uint64_t latency = mono_ns() - accepted;
+		unsigned status = resp->status();
+		metrics->count(hostid, ep, status);
+		metrics->total(ep, latency);
+		log_request(wreq, ev, ep, status, latency);
+	}
+
+	// Reads one request and replies to it, accepted is the time it was
+	// accepted at (if it waited in the queue, zero otherwise)
+	void serve(FCGX_Request *req, uint64_t accepted) {
+		uint64_t start = mono_ns();
+
+		// Read request body and validate it
+		int bsize = atoi(FCGX_GetParam("CONTENT_LENGTH", req->envp) ?: "0");
+		bsize = std::max(0, std::min(bsize, MAX_REQ_SIZE));
+
+		char body[MAX_REQ_SIZE+1];
+		int blen = bsize ? std::max(0, FCGX_GetStr(body, bsize, req->in)) : 0;
+		body[blen] = 0;
+
+		Response resp;
+		process(req->envp, std::string_view(body, blen), accepted ?: start, start, &resp);
+		resp.write(req->out);
 	}
 
-	static unsigned totp_calc(std::string key, htAlgo algo, uint8_t digits, uint32_t epoch) {
-		const uint32_t po10[] = {
-			1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
-		std::string(* const algtbl[])(std::string, std::string) = {
-			hmac_sha1, hmac_sha256, hmac_sha512
-		};
-		// Key comes in binary format already!
-		// Concatenate the epoc in big endian fashion
-		uint8_t msg [8] = {
-			0, 0, 0, 0,
-			(uint8_t)(epoch >> 24),
-			(uint8_t)((epoch >> 16) & 255),
-			(uint8_t)((epoch >>  8) & 255),
-			(uint8_t)(epoch & 255)
-		};
+	// Replies to a request read by an event loop (the body is there already)
+	void serve(AsyncRequest *req, uint64_t accepted) {
+		Response resp;
+		process(req->envp.data(), req->body, accepted, mono_ns(), &resp);
+		req->respond(resp);
+	}
 
-		std::string hashs = algtbl[(unsigned)algo](key, std::string((char*)msg, sizeof(msg)));
-		uint8_t *hash = (uint8_t*)hashs.c_str();
+	// Thread entry point: pins the thread before it allocates anything (so
+	// its buffers end up on its node) and runs work(), or accept_work() when
+	// accepting ourselves
+	void run() {
+		pin_thread(pthread_self(), cpus, id);
+		if (lsock < 0)
+			work();
+		else
+			accept_work();
+	}
 
-		// The last nibble of the hash is an offset:
-		unsigned off = hash[hashs.size() - 1] & 15;
-		// The result is a substr in hash at that offset (pick 32 bits)
-		uint32_t value = (hash[off] << 24) | (hash[off+1] << 16) | (hash[off+2] << 8) | hash[off+3];
-		value &= 0x7fffffff;
-		return value % po10[digits];
+	// Whether a request waited past the deadline, nginx likely gave up on
+	// it already so rather than computing anything it gets a 503.
+	bool shed(queued_req_t *req) {
+		if (!deadline || mono_ns() - req->accepted <= deadline)
+			return false;
+		char **envp = req->async ? req->async->envp.data() : req->fcgx.envp;
+		const char *uri = FCGX_GetParam("DOCUMENT_URI", envp) ?: "";
+		metrics->inc(strcmp(uri, "/auth") ? ctShedOther : ctShedAuth);
+		if (req->async) {
+			Response resp;
+			resp.add(resp_busy);
+			req->async->respond(resp);
+			rpool->release(req);
+		}
+		else {
+			FCGX_PutStr(resp_busy.data(), resp_busy.size(), req->fcgx.out);
+			finish_req(req, idle, rpool);
+		}
+		return true;
 	}
 
-	// Receives requests and processes them by replying via a side http call.
+	// Receives requests from the shared queue and processes them.
 	void work() {
-		std::unique_ptr<FCGX_Request> req;
-		while (rq->pop(&req)) {
-			// Read request body and validate it
-			int bsize = atoi(FCGX_GetParam("CONTENT_LENGTH", req->envp));
-			bsize = std::max(0, std::min(bsize, MAX_REQ_SIZE));
-
-			// Get streams to write
-			fcgi_streambuf reqout(req->out);
-			fcgi_streambuf reqin(req->in);
-			std::iostream obuf(&reqout);
-			std::iostream ibuf(&reqin);
-
-			char body[MAX_REQ_SIZE+1];
-			ibuf.read(body, bsize);
-			body[bsize] = 0;
-
-			// Find out basic info
-			web_req wreq;
-			wreq.method   = FCGX_GetParam("REQUEST_METHOD", req->envp) ?: "";
-			wreq.uri      = FCGX_GetParam("DOCUMENT_URI", req->envp) ?: "";
-			wreq.getvars  = parse_vars(FCGX_GetParam("QUERY_STRING", req->envp) ?: "");
-			wreq.postvars = parse_vars(body);
-			wreq.host     = FCGX_GetParam("HTTP_HOST", req->envp) ?: "";
-			wreq.cookies  = parse_cookies(FCGX_GetParam("HTTP_COOKIE", req->envp) ?: "");
-
-			// Extract source IP
-			const char *sip = FCGX_GetParam("REMOTE_ADDR", req->envp) ?: "0.0.0.0";
-			struct in6_addr res6; struct in_addr res4;
-			if (inet_pton(AF_INET6, sip, &res6) == 1)
-				wreq.ip64 = ((uint64_t)res6.s6_addr[0] << 40) | ((uint64_t)res6.s6_addr[1] << 32) |
-				            ((uint64_t)res6.s6_addr[2] << 24) | ((uint64_t)res6.s6_addr[3] << 16) |
-				            ((uint64_t)res6.s6_addr[4] <<  8) | ((uint64_t)res6.s6_addr[5]);
-			else if (inet_pton(AF_INET, sip, &res4) == 1)
-				wreq.ip64 = res4.s_addr;
-			else
-				wreq.ip64 = 0;
-
-			// Lookup hostname for this request
-			if (!webcfg.count(wreq.host)) {
-				logger->log("Failed to find host '" + wreq.host + "'");
-				obuf << "Status: 500\r\nContent-Type: text/plain\r\n"
-					 << "Content-Length: " << (wreq.host.size() + 18) << "\r\n\r\n"
-					 << "Unknown hostname: " << wreq.host;
+		queued_req_t *req;
+		while ((!gate || gate->pass(id)) && rq->pop(&req)) {
+			if (shed(req))
+				continue;
+			if (req->async) {
+				serve(req->async, req->accepted);
+				rpool->release(req);
 			}
 			else {
-				const web_t* wptr = &webcfg.at(wreq.host);
-				std::string resp = process_req(&wreq, wptr);
-
-				// Respond with an immediate update JSON encoded too
-				obuf << resp;
+				serve(&req->fcgx, req->accepted);
+				finish_req(req, idle, rpool);
 			}
-
-			FCGX_Finish_r(req.get());
-			req.reset();
 		}
 	}
-};
 
-bool serving = true;
-void sighandler(int) {
-	std::cerr << "Signal caught" << std::endl;
-	// Just tweak a couple of vars really
-	serving = false;
-	// Ask for CGI lib shutdown
-	FCGX_ShutdownPending();
-	// Close stdin so we stop accepting
-	close(0);
-}
-
-int main(int argc, char **argv) {
-	if (argc < 2) {
-		std::cerr << "Usage: " << argv[0] << " file.conf" << std::endl;
-		return 1;
+	// Accepts and processes requests on its own (per_worker accept mode).
+	void accept_work() {
+		FCGX_Request req;
+		FCGX_InitRequest(&req, lsock, 0);
+		while (serving && FCGX_Accept_r(&req) >= 0) {
+			serve(&req, 0);
+			FCGX_Finish_r(&req);
+		}
 	}
+};
 
-	config_t cfg;
-	config_init(&cfg);
-	if (!config_read_file(&cfg, argv[1]))
-		RET_ERR("Error reading config file");
-
-	// Read config vars
-	config_lookup_int(&cfg, "nthreads", (int*)&nthreads);
-	nthreads = std::max(nthreads, 1);
-	// Number of auth attempts (per ~IP?) per second
-	unsigned auths_per_second = 2;
-	config_lookup_int(&cfg, "auth_per_second", (int*)&auths_per_second);
-	// Secret holds the server secret used to create cookies
-	const char *secret;
-	if (!config_lookup_string(&cfg, "secret", &secret))
-		RET_ERR("'secret' missing, this field is required");
-	// Secret holds the server secret used to create cookies
-	const char *logpath = "/tmp/totp_auth";
-	if (!config_lookup_string(&cfg, "log-path", &logpath))
-		std::cerr << "'log-path' not specified, using default /tmp/totp_auth path" << std::endl;
-
-	config_setting_t *webs_cfg = config_lookup(&cfg, "webs");
+// Parses and validates the webs (hosts, users and their settings) into an
+// image. Returns non-zero on error.
+static int compile_webs(config_t *cfg, std::string *out) {
+	config_setting_t *webs_cfg = config_lookup(cfg, "webs");
 	if (!webs_cfg)
 		RET_ERR("Missing 'webs' config array definition");
 	int webscnt = config_setting_length(webs_cfg);
 	if (!webscnt)
 		RET_ERR("webscnt must be an array of 1 or more elements");
 
+	ImageWriter img;
 	for (int i = 0; i < webscnt; i++) {
 		config_setting_t *webentry  = config_setting_get_elem(webs_cfg, i);
 		config_setting_t *hostname  = config_setting_get_member(webentry, "hostname");
@@ -375,10 +574,8 @@ int main(int argc, char **argv) {
 
 		if (!webentry || !hostname || !wtemplate || !users_cfg)
 			RET_ERR("hostname, template and users must be present in the web group");
-
-		web_t wentry = {
-			.webtemplate = config_setting_get_string(wtemplate),
-			.totp_generations = !totp_gens ? TOTP_DEF_GENS : (unsigned)config_setting_get_int(totp_gens) };
+		img.add_web(config_setting_get_string(hostname), config_setting_get_string(wtemplate),
+		            !totp_gens ? TOTP_DEF_GENS : (unsigned)config_setting_get_int(totp_gens));
 
 		for (int j = 0; j < config_setting_length(users_cfg); j++) {
 			config_setting_t *userentry = config_setting_get_elem(users_cfg, j);
@@ -403,52 +600,714 @@ int main(int argc, char **argv) {
 			if (!algnames.count(algorithm))
 				RET_ERR("invalid algorithm specified");
 
-			wentry.users[config_setting_get_string(user)] = cred_t {
-				.password = config_setting_get_string(pass),
-				.totp = b32dec(b32pad(config_setting_get_string(totp))),
-				.sduration = (unsigned)config_setting_get_int(durt),
-				.digits = (unsigned)digits,
-				.period = (unsigned)period,
-				algnames.at(algorithm) };
+			if (!PasswordHash(config_setting_get_string(pass)).valid())
+				RET_ERR("invalid password hash for user " << config_setting_get_string(user));
+
+			htAlgo halgo = algnames.at(algorithm);
+			img.add_user(config_setting_get_string(user), config_setting_get_string(pass),
+			             b32dec(b32pad(config_setting_get_string(totp))), algo_md(halgo), halgo,
+			             (unsigned)config_setting_get_int(durt), digits, period);
+		}
+	}
+	*out = img.finish();
+	return 0;
+}
+
+// Builds the webs config in out from an image, prev is the config currently
+// in use (if any). Users get their revocation slot in rev (if any). Returns
+// non-zero on error.
+static int load_webs(const ConfigImage &img, const webcfg_t *prev, webcfg_t *out, RevocationList *rev) {
+	// Hosts keep their ids across reloads (for metrics), new ones get new ids
+	if (prev)
+		out->hostnames = prev->hostnames;
+	out->generation = prev ? prev->generation + 1 : 1;
+
+	// Revoked tokens must be kept around for as long as sessions last
+	int64_t max_duration = 0;
+
+	for (unsigned i = 0; i < img.nwebs(); i++) {
+		const img_web_t &w = img.web(i);
+		std::string hname(img.str(w.hostname));
+
+		web_t wentry = {
+			.webtemplate = std::string(img.str(w.webtemplate)),
+			.totp_generations = w.totp_generations };
+
+		for (unsigned j = w.first_user; j < w.first_user + w.nusers; j++) {
+			const img_user_t &u = img.user(j);
+			std::string_view uname = img.str(u.username);
+			if (u.digits < 6 || u.digits > 9 || !u.period || u.algorithm > hAlgoSha512)
+				RET_ERR("invalid TOTP settings for user " << uname);
+			PasswordHash password(img.str(u.password));
+			if (!password.valid())
+				RET_ERR("invalid password hash for user " << uname);
+
+			// Users are numbered in config order (a repeated one keeps its number)
+			htAlgo halgo = (htAlgo)u.algorithm;
+			const cred_t *prevc = wentry.users.find(uname);
+			unsigned uid = prevc ? prevc->uid : wentry.users.size();
+			cred_t &cred = wentry.users[uname];
+			cred = cred_t {
+				.password = std::move(password),
+				.totp = HmacKey(algo_md(halgo), img.str(u.totp)),
+				.sduration = u.sduration,
+				.digits = u.digits,
+				.period = u.period,
+				.algorithm = halgo,
+				.uid = uid,
+				.window = std::make_shared<totp_window_t>(),
+				.notbefore = rev ? rev->user(hname, uname) : nullptr };
+			if (!wentry.decoy.hashed())
+				wentry.decoy = cred.password.decoy();
+			if (rev && !cred.notbefore)
+				std::cerr << "No room in the revocation file for user " << uname << std::endl;
+			max_duration = std::max(max_duration, (int64_t)u.sduration);
+		}
+
+		// Render the static bits of the login page for this host
+		wentry.has_page = templates.count(wentry.webtemplate);
+		if (wentry.has_page) {
+			for (bool err : {false, true})
+				wentry.login_page[err] = prerender_page(templates.at(wentry.webtemplate), hname, err);
+		}
+
+		auto hit = std::find(out->hostnames.begin(), out->hostnames.end(), hname);
+		wentry.hostid = hit - out->hostnames.begin();
+		if (hit == out->hostnames.end())
+			out->hostnames.push_back(hname);
+		out->webs[hname] = wentry;
+	}
+	if (rev)
+		rev->set_period(max_duration);
+	return 0;
+}
+
+// Loads the webs config from the precompiled image, if there's one, or from
+// the webs section of cfg otherwise. Returns non-zero on error.
+static int load_webs(config_t *cfg, const char *image, const webcfg_t *prev, webcfg_t *out,
+                     RevocationList *rev) {
+	if (image) {
+		ConfigImage img(image);
+		if (!img.valid())
+			RET_ERR("Could not load the webs image " << image << " (missing, corrupt or outdated)");
+		return load_webs(img, prev, out, rev);
+	}
+
+	std::string buf;
+	if (compile_webs(cfg, &buf))
+		return 1;
+	return load_webs(ConfigImage(buf), prev, out, rev);
+}
+
+// Re-reads the config file (or image) and publishes the new webs config,
+// requests in flight keep using the snapshot they hold. Returns the previous
+// snapshot, or null (keeping the current config) on error.
+static std::shared_ptr<const webcfg_t> reload_webs(const char *cfgfile, const char *image, RevocationList *rev,
+                                                   Metrics *metrics) {
+	auto prev = std::atomic_load(&webcfg);
+	auto snapshot = std::make_shared<webcfg_t>();
+	config_t cfg;
+	config_init(&cfg);
+	bool ok = (image || config_read_file(&cfg, cfgfile)) &&
+	          !load_webs(&cfg, image, prev.get(), snapshot.get(), rev);
+	config_destroy(&cfg);
+	if (!ok)
+		return nullptr;
+
+	metrics->set_hostnames(snapshot->hostnames);
+	std::atomic_store(&webcfg, std::shared_ptr<const webcfg_t>(snapshot));
+	webcfg_gen.store(snapshot->generation, std::memory_order_release);
+	return prev;
+}
+
+// Reloads the webs config every time SIGHUP is received (see reload_webs).
+static void reloader(const char *cfgfile, const char *image, RevocationList *rev, Metrics *metrics,
+                     Logger *logger) {
+	sigset_t hup;
+	sigemptyset(&hup);
+	sigaddset(&hup, SIGHUP);
+	int sig;
+	while (!sigwait(&hup, &sig) && serving) {
+		auto prev = reload_webs(cfgfile, image, rev, metrics);
+		if (!prev) {
+			std::cerr << "Config reload failed, keeping the current config" << std::endl;
+			logger->log("Config reload failed, keeping the current config");
+			continue;
+		}
+		logger->log("Config reloaded, generation " + std::to_string(webcfg_gen.load()));
+
+		// Give workers a chance to move on, so that the old config is freed
+		// here rather than by a worker in the middle of a request.
+		for (unsigned i = 0; i < 100 && prev.use_count() > 1; i++)
+			usleep(10000);
+	}
+}
+
+// Sockets to shut down to stop accepting
+std::vector<int> listen_socks;
+
+// Opens a TCP listen socket with SO_REUSEPORT, so that every worker can
+// have its own socket on the same address (the kernel balances among them).
+static int open_reuseport_socket(const std::string &addr) {
+	auto p = addr.rfind(':');
+	std::string host = addr.substr(0, p), port = addr.substr(p + 1);
+	struct addrinfo hints = {}, *res;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res))
+		return -1;
+
+	int one = 1;
+	int fd = socket(res->ai_family, SOCK_STREAM, 0);
+	if (fd >= 0) {
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+		if (bind(fd, res->ai_addr, res->ai_addrlen) || listen(fd, LISTEN_BACKLOG)) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+// Pre-fork mode: runs nprocs worker processes (pinned to cpus, if any) and
+// restarts the ones that die, forwarding SIGHUP to them. Returns the worker
+// number in the workers, and -1 in the master once all of them exited.
+// on_master is called in the master once the workers are forked, ie. to
+// start threads only the master needs, and on_hup on every SIGHUP before
+// forwarding it, so that restarted workers start off the current config.
+static int prefork(unsigned nprocs, const std::vector<int> &cpus, const std::function<void()> &on_master,
+                   const std::function<void()> &on_hup) {
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigaddset(&set, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+	// Forks worker i, returns true in the worker
+	std::vector<pid_t> pids(nprocs, -1);
+	std::vector<time_t> started(nprocs, 0);
+	auto spawn = [&](unsigned i) {
+		started[i] = time(0);
+		pid_t pid = fork();
+		if (pid) {
+			if (pid < 0)
+				std::cerr << "Could not fork worker process " << i << std::endl;
+			pids[i] = pid;
+			return false;
+		}
+		// Don't outlive the master
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		pin_thread(pthread_self(), cpus, i);
+		sigset_t chld;
+		sigemptyset(&chld);
+		sigaddset(&chld, SIGCHLD);
+		pthread_sigmask(SIG_UNBLOCK, &chld, nullptr);
+		return true;
+	};
+
+	for (unsigned i = 0; i < nprocs; i++)
+		if (spawn(i))
+			return i;
+	on_master();
+
+	while (serving) {
+		struct timespec ts = {1, 0};
+		if (sigtimedwait(&set, nullptr, &ts) == SIGHUP) {
+			on_hup();
+			for (pid_t p : pids)
+				if (p > 0)
+					kill(p, SIGHUP);
+		}
+
+		int st;
+		pid_t pid;
+		while ((pid = waitpid(-1, &st, WNOHANG)) > 0) {
+			for (unsigned i = 0; i < nprocs; i++) {
+				if (pids[i] == pid) {
+					std::cerr << "Worker process " << i << " exited (status " << st << ")" << std::endl;
+					pids[i] = -1;
+				}
+			}
+		}
+
+		// Restart the dead ones, but not more than once a second
+		for (unsigned i = 0; i < nprocs && serving; i++) {
+			if (pids[i] < 0 && time(0) > started[i] && spawn(i))
+				return i;
+		}
+	}
+
+	for (pid_t p : pids)
+		if (p > 0)
+			kill(p, SIGTERM);
+	for (pid_t p : pids)
+		if (p > 0)
+			waitpid(p, nullptr, 0);
+	return -1;
+}
+
+void sighandler(int) {
+	std::cerr << "Signal caught" << std::endl;
+	// Just tweak a couple of vars really
+	serving = false;
+	// Ask for CGI lib shutdown
+	FCGX_ShutdownPending();
+	// Close stdin so we stop accepting
+	close(0);
+	for (int fd : listen_socks)
+		shutdown(fd, SHUT_RDWR);
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		std::cerr << "Usage: " << argv[0] << " file.conf [revoke hostname username | compile webs.img]" << std::endl;
+		return 1;
+	}
+
+	config_t cfg;
+	config_init(&cfg);
+	if (!config_read_file(&cfg, argv[1]))
+		RET_ERR("Error reading config file");
+
+	// Compile the webs section into an image (see webs_image) and exit
+	if (argc == 4 && !strcmp(argv[2], "compile")) {
+		std::string img;
+		if (compile_webs(&cfg, &img))
+			return 1;
+		if (!ConfigImage::write(img, argv[3]))
+			RET_ERR("Could not write the webs image " << argv[3]);
+		std::cerr << "Wrote " << img.size() << " bytes to " << argv[3] << std::endl;
+		return 0;
+	}
+
+	// Read config vars
+	config_lookup_int(&cfg, "nthreads", (int*)&nthreads);
+	nthreads = std::max(nthreads, 1);
+	// Adaptive pool: up to max_threads workers (nthreads at least), more are
+	// let in while requests wait in the queue longer than scale_target_wait
+	// (us) on average, checked every scale_interval (ms)
+	int max_threads = nthreads;
+	config_lookup_int(&cfg, "max_threads", &max_threads);
+	max_threads = std::max(max_threads, nthreads);
+	unsigned scale_target_wait = 1000;
+	config_lookup_int(&cfg, "scale_target_wait", (int*)&scale_target_wait);
+	unsigned scale_interval = 1000;
+	config_lookup_int(&cfg, "scale_interval", (int*)&scale_interval);
+	// Queue implementation ("list", "ring" or "lanes") and its capacity
+	const char *queue_type = "list";
+	config_lookup_string(&cfg, "queue_type", &queue_type);
+	unsigned queue_size = 1024;
+	config_lookup_int(&cfg, "queue_size", (int*)&queue_size);
+	queue_size = std::max(queue_size, 1U);
+	// With lanes, capacity of the non-/auth lane (queue_size is for /auth)
+	unsigned login_queue_size = 64;
+	config_lookup_int(&cfg, "login_queue_size", (int*)&login_queue_size);
+	login_queue_size = std::max(login_queue_size, 1U);
+	// Requests waiting in the queue for longer (ms) are shed with a 503,
+	// ideally below nginx's fastcgi_read_timeout (0 disables it)
+	unsigned queue_deadline = 0;
+	config_lookup_int(&cfg, "queue_deadline", (int*)&queue_deadline);
+	// Listen address (unix socket path or host:port), uses stdin otherwise
+	const char *listen_addr = nullptr;
+	config_lookup_string(&cfg, "listen", &listen_addr);
+	// Either accept on the main thread and dispatch via queue or make
+	// every worker accept connections ("queue" or "per_worker")
+	const char *accept_mode = "queue";
+	config_lookup_string(&cfg, "accept_mode", &accept_mode);
+	bool per_worker = !strcmp(accept_mode, "per_worker");
+	if (!per_worker && strcmp(accept_mode, "queue"))
+		RET_ERR("accept_mode must be either 'queue' or 'per_worker'");
+	// Front end reading the FastCGI connections: blocking libfcgi calls
+	// ("threads") or event loops handing complete requests to the workers
+	// ("epoll"), which needs the queue accept mode.
+	const char *frontend = "threads";
+	config_lookup_string(&cfg, "frontend", &frontend);
+	bool epoll = !strcmp(frontend, "epoll");
+	if (!epoll && strcmp(frontend, "threads"))
+		RET_ERR("frontend must be either 'threads' or 'epoll'");
+	if (epoll && per_worker)
+		RET_ERR("frontend 'epoll' can only be used with accept_mode 'queue'");
+	if (max_threads > nthreads && per_worker)
+		RET_ERR("max_threads can only be used with accept_mode 'queue'");
+	bool adaptive = max_threads > nthreads;
+	int nworkers = adaptive ? max_threads : nthreads;
+	int event_threads = 1;
+	config_lookup_int(&cfg, "event_threads", &event_threads);
+	event_threads = std::max(event_threads, 1);
+	// Pre-fork mode: run this many worker processes (each with nthreads
+	// workers), optionally pinned to these cpus (round robin)
+	unsigned processes = 1;
+	config_lookup_int(&cfg, "processes", (int*)&processes);
+	auto cpu_list = [&](const char *name) {
+		std::vector<int> ret;
+		if (config_setting_t *cpulist = config_lookup(&cfg, name)) {
+			for (int i = 0; i < config_setting_length(cpulist); i++)
+				ret.push_back(config_setting_get_int_elem(cpulist, i));
 		}
+		return ret;
+	};
+	std::vector<int> cpus = cpu_list("cpus");
+	// Pin workers (round robin), the acceptor and event loop threads, and
+	// the log flushers to these cpus, ie. to keep them on one node
+	std::vector<int> worker_cpus = cpu_list("worker_cpus");
+	std::vector<int> acceptor_cpus = cpu_list("acceptor_cpus");
+	std::vector<int> logger_cpus = cpu_list("logger_cpus");
+	// Use one SO_REUSEPORT socket per worker or event loop (TCP listen only)
+	int reuseport = 0;
+	config_lookup_bool(&cfg, "reuseport", &reuseport);
+	// Idle kept alive connections (nginx fastcgi_keep_conn) to hold on to,
+	// and for how long (seconds), 0 closes connections after every request.
+	// Event loops close connections making no progress for that long too.
+	unsigned keepalive_conns = 128;
+	config_lookup_int(&cfg, "keepalive_conns", (int*)&keepalive_conns);
+	unsigned keepalive_timeout = 120;
+	config_lookup_int(&cfg, "keepalive_timeout", (int*)&keepalive_timeout);
+	// Number of auth attempts (per ~IP?) per second
+	unsigned auths_per_second = 2;
+	config_lookup_int(&cfg, "auth_per_second", (int*)&auths_per_second);
+	// Number of login attempts per second against a single user (from any
+	// source), the same as per source by default
+	unsigned user_auths_per_second = auths_per_second;
+	config_lookup_int(&cfg, "user_auth_per_second", (int*)&user_auths_per_second);
+	// Number of sources the rate limiter keeps track of
+	unsigned ratelimit_slots = 65536;
+	config_lookup_int(&cfg, "ratelimit_slots", (int*)&ratelimit_slots);
+	// Keep the rate limiter in this shared memory segment (ie. "/totp_auth_rl"),
+	// so that every instance on the host shares it
+	const char *ratelimit_shm = nullptr;
+	config_lookup_string(&cfg, "ratelimit_shm", &ratelimit_shm);
+	// Share rate limiting with other hosts: address to receive peer updates
+	// on, the peers to send ours to ("host:port") and how often (ms)
+	const char *cluster_listen = nullptr;
+	config_lookup_string(&cfg, "cluster_listen", &cluster_listen);
+	std::vector<std::string> cluster_peers;
+	if (config_setting_t *peers = config_lookup(&cfg, "cluster_peers")) {
+		for (int i = 0; i < config_setting_length(peers); i++)
+			cluster_peers.push_back(config_setting_get_string_elem(peers, i) ?: "");
+	}
+	unsigned cluster_interval = 100;
+	config_lookup_int(&cfg, "cluster_interval", (int*)&cluster_interval);
+	// Number of verified cookies to cache (zero disables it)
+	unsigned cookie_cache_size = 8192;
+	config_lookup_int(&cfg, "cookie_cache_size", (int*)&cookie_cache_size);
+	// Secret holds the server secret used to create cookies
+	const char *secret;
+	if (!config_lookup_string(&cfg, "secret", &secret))
+		RET_ERR("'secret' missing, this field is required");
+	// Threads verifying hashed passwords and how many verifications can be
+	// pending at once (further logins get a 503 until there's room)
+	unsigned password_threads = 1;
+	config_lookup_int(&cfg, "password_threads", (int*)&password_threads);
+	password_threads = std::max(password_threads, 1U);
+	unsigned password_queue = std::max(nthreads / 2, 1);
+	config_lookup_int(&cfg, "password_queue", (int*)&password_queue);
+	password_queue = std::max(password_queue, 1U);
+	// Format of the issued cookies ("compact" or "legacy"), both are accepted
+	const char *cookie_format = "compact";
+	config_lookup_string(&cfg, "cookie_format", &cookie_format);
+	bool compact_cookies = !strcmp(cookie_format, "compact");
+	if (!compact_cookies && strcmp(cookie_format, "legacy"))
+		RET_ERR("cookie_format must be either 'compact' or 'legacy'");
+	// Secret holds the server secret used to create cookies
+	const char *logpath = "/tmp/totp_auth";
+	if (!config_lookup_string(&cfg, "log-path", &logpath))
+		std::cerr << "'log-path' not specified, using default /tmp/totp_auth path" << std::endl;
+	// Per thread log buffer, lines are dropped when it fills up
+	unsigned log_buffer_size = 256*1024;
+	config_lookup_int(&cfg, "log_buffer_size", (int*)&log_buffer_size);
+	// Start a new log file once it reaches this size (bytes, 0 means daily
+	// only) and sync it to disk at most this often (ms, 0 leaves it to the OS)
+	unsigned log_max_size = 0;
+	config_lookup_int(&cfg, "log_max_size", (int*)&log_max_size);
+	unsigned log_sync_interval = 0;
+	config_lookup_int(&cfg, "log_sync_interval", (int*)&log_sync_interval);
+	// Log requests as text lines or as binary records ("text" or "binary")
+	const char *log_format = "text";
+	config_lookup_string(&cfg, "log_format", &log_format);
+	bool audit_log = !strcmp(log_format, "binary");
+	if (!audit_log && strcmp(log_format, "text"))
+		RET_ERR("log_format must be either 'text' or 'binary'");
+	// Serve counters and latency histograms at /metrics
+	int metrics_enabled = 0;
+	config_lookup_bool(&cfg, "metrics", &metrics_enabled);
+	// Load the webs from this precompiled image (see the compile command)
+	// instead of the webs section, also on reloads
+	const char *webs_image = nullptr;
+	config_lookup_string(&cfg, "webs_image", &webs_image);
+	// Server side session revocation, kept in this file (disabled by default),
+	// with room for this many users and bits per token filter
+	const char *revocation_file = nullptr;
+	config_lookup_string(&cfg, "revocation_file", &revocation_file);
+	unsigned revocation_users = 4096;
+	config_lookup_int(&cfg, "revocation_users", (int*)&revocation_users);
+	revocation_users = std::max(revocation_users, 1U);
+	unsigned revocation_bits = 1 << 20;
+	config_lookup_int(&cfg, "revocation_bits", (int*)&revocation_bits);
+
+	std::unique_ptr<RevocationList> revlist;
+	if (revocation_file) {
+		revlist.reset(new RevocationList(revocation_file, revocation_users, revocation_bits));
+		if (!revlist->valid())
+			RET_ERR("Could not open the revocation file " << revocation_file);
+	}
 
-		webcfg[config_setting_get_string(hostname)] = wentry;
+	// Revoke all the sessions of a user and exit, running servers see it
+	if (argc > 2) {
+		if (argc != 5 || strcmp(argv[2], "revoke"))
+			RET_ERR("Usage: " << argv[0] << " file.conf [revoke hostname username | compile webs.img]");
+		if (!revlist)
+			RET_ERR("'revocation_file' must be configured to revoke sessions");
+		std::atomic<int64_t> *notbefore = revlist->user(argv[3], argv[4]);
+		if (!notbefore)
+			RET_ERR("No room left in the revocation file");
+		revlist->revoke_user(notbefore);
+		std::cerr << "Revoked all the sessions of " << argv[4] << " at " << argv[3] << std::endl;
+		return 0;
 	}
 
-	// Start FastCGI interface
+	auto snapshot = std::make_shared<webcfg_t>();
+	if (load_webs(&cfg, webs_image, nullptr, snapshot.get(), revlist.get()))
+		return 1;
+	std::atomic_store(&webcfg, std::shared_ptr<const webcfg_t>(snapshot));
+
+	// Start FastCGI interface. SO_REUSEPORT sockets are opened by every
+	// process (after forking), the rest are shared.
 	FCGX_Init();
+	int lsock = 0;
+	bool reuse = (per_worker || epoll || processes > 1) && reuseport && listen_addr && strchr(listen_addr, ':');
+	if (listen_addr && !reuse) {
+		lsock = FCGX_OpenSocket(listen_addr, LISTEN_BACKLOG);
+		if (lsock < 0)
+			RET_ERR("Could not listen on " << listen_addr);
+		listen_socks.push_back(lsock);
+	}
+	else if (!listen_addr)
+		listen_socks.push_back(lsock);
 
 	// Signal handling
 	signal(SIGINT, sighandler); 
 	signal(SIGTERM, sighandler);
 	signal(SIGPIPE, SIG_IGN);
+	// SIGHUP is only handled by the reloader thread (threads inherit the mask)
+	sigset_t hup;
+	sigemptyset(&hup);
+	sigaddset(&hup, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &hup, nullptr);
+
+	if (cluster_listen && !*secret)
+		RET_ERR("cluster_listen requires a 'secret' shared by all the peers");
+
+	// Cookie key, shared by all workers so they agree on random secrets too
+	cookie_keys_t cookie_keys(*secret ? std::string(secret) : randstr());
+
+	// State shared by all the worker processes in pre-fork mode
+	std::unique_ptr<ShmArena> arena;
+	if (processes > 1) {
+		arena.reset(new ShmArena(2 * RateLimiter::arena_size(ratelimit_slots) +
+		                         CookieCache::arena_size(cookie_cache_size) + GossipTable::arena_size()));
+		if (!arena->valid())
+			RET_ERR("Could not allocate shared memory for " << processes << " processes");
+	}
+
+	std::unique_ptr<RateLimiter> globalrl(
+		ratelimit_shm ? new RateLimiter(auths_per_second, ratelimit_slots, ratelimit_shm) :
+		arena ? new RateLimiter(auths_per_second, ratelimit_slots, arena.get()) :
+		        new RateLimiter(auths_per_second, ratelimit_slots));
+	if (!globalrl->valid())
+		RET_ERR("Could not set up the rate limiter in shared memory " << ratelimit_shm <<
+		        " (in use with other parameters?)");
+	std::unique_ptr<RateLimiter> userrl(arena ? new RateLimiter(user_auths_per_second, ratelimit_slots, arena.get()) :
+	                                            new RateLimiter(user_auths_per_second, ratelimit_slots));
+	if (!userrl->valid())
+		RET_ERR("Could not set up the per user rate limiter in shared memory");
+	std::unique_ptr<CookieCache> cookiecache(arena ? new CookieCache(cookie_cache_size, arena.get()) :
+	                                                 new CookieCache(cookie_cache_size));
+	if (!cookiecache->valid())
+		RET_ERR("Could not set up the cookie cache in shared memory");
+	Metrics metrics(snapshot->hostnames, snapshot->hostnames.size() + METRICS_SPARE_HOSTS, metrics_enabled);
+	// Workers note hits in the table, in pre-fork mode only the master
+	// talks to the peers (its counters aren't exposed)
+	std::unique_ptr<GossipTable> gossiptable;
+	std::unique_ptr<ClusterGossip> cluster;
+	if (cluster_listen) {
+		gossiptable.reset(new GossipTable(arena.get()));
+		cluster.reset(new ClusterGossip(gossiptable.get(), globalrl.get(), secret, cluster_listen, cluster_peers,
+		                                cluster_interval, arena ? nullptr : &metrics));
+		if (!cluster->valid())
+			RET_ERR("Could not set up cluster state on " << cluster_listen);
+	}
+
+	int procidx = 0;
+	if (processes > 1) {
+		auto on_hup = [&] {
+			if (!reload_webs(argv[1], webs_image, revlist.get(), &metrics))
+				std::cerr << "Config reload failed, keeping the current config" << std::endl;
+		};
+		if ((procidx = prefork(processes, cpus, [&] { if (cluster) cluster->start(); }, on_hup)) < 0)
+			return 0;    // Master, all the workers are gone
+		// The gossip belongs to the master (restarted workers have a copy
+		// of it whose thread doesn't exist here), just leave it alone.
+		cluster.release();
+	}
+	else if (cluster)
+		cluster->start();
+
+	if (reuse) {
+		for (int i = 0; i < (epoll ? event_threads : per_worker ? nthreads : 1); i++) {
+			int fd = open_reuseport_socket(listen_addr);
+			if (fd < 0)
+				RET_ERR("Could not listen on " << listen_addr);
+			listen_socks.push_back(fd);
+		}
+		lsock = listen_socks[0];
+	}
+
+	// Start worker threads for this. Every process rotates its logs on its
+	// own (and binary logs are written at block offsets), so each needs its own.
+	std::string proclogpath = processes > 1 ? logpath + std::string("_p") + std::to_string(procidx) : logpath;
+	auto logger = std::make_unique<Logger>(proclogpath, log_buffer_size, log_max_size, log_sync_interval, &metrics);
+	std::unique_ptr<AuditLog> audit;
+	if (audit_log)
+		audit.reset(new AuditLog(proclogpath, log_buffer_size, &metrics));
+	logger->pin(logger_cpus);
+	if (audit)
+		audit->pin(logger_cpus);
+	VerifyPool verifypool(password_threads, password_queue);
+	std::unique_ptr<WorkQueue<queued_req_t*>> reqqueue;
+	LaneQueue<queued_req_t*> *lanes = nullptr;
+	if (!strcmp(queue_type, "ring"))
+		reqqueue.reset(new RingQueue<queued_req_t*>(queue_size));
+	else if (!strcmp(queue_type, "list"))
+		reqqueue.reset(new ConcurrentQueue<queued_req_t*>());
+	else if (!strcmp(queue_type, "lanes"))
+		reqqueue.reset(lanes = new LaneQueue<queued_req_t*>(queue_size, login_queue_size));
+	else
+		RET_ERR("queue_type must be either 'list', 'ring' or 'lanes'");
+	// Kept alive connections are only parked when the acceptor dispatches
+	// libfcgi requests (per-worker accepting keeps them on the worker and the
+	// event loops deal with them on their own).
+	bool keepalive = !per_worker && !epoll && keepalive_conns;
+	// Enough requests to fill the queue(s), keep every worker busy and
+	// hold the idle connections
+	ObjectPool<queued_req_t> reqpool(queue_size + (lanes ? login_queue_size : 0) + nworkers + 1 +
+	                                 (keepalive ? keepalive_conns : 0));
+	std::unique_ptr<IdlePoller<queued_req_t>> idle;
+
+	// Queues a libfcgi request for the workers. Subrequests go in the
+	// priority lane, when a lane is full we reply right away rather than
+	// letting nginx time out.
+	auto enqueue = [&](queued_req_t *request) {
+		request->accepted = mono_ns();
+		if (!lanes)
+			return reqqueue->push(request);
+
+		const char *uri = FCGX_GetParam("DOCUMENT_URI", request->fcgx.envp) ?: "";
+		unsigned lane = strcmp(uri, "/auth") ? 1 : 0;
+		if (!lanes->try_push(request, lane)) {
+			FCGX_PutStr(resp_busy.data(), resp_busy.size(), request->fcgx.out);
+			metrics.inc(lane ? ctLaneOtherRejected : ctLaneAuthRejected);
+			finish_req(request, idle.get(), &reqpool);
+		}
+	};
+	if (keepalive) {
+		idle.reset(new IdlePoller<queued_req_t>(&reqpool, keepalive_conns, keepalive_timeout, enqueue));
+		idle->pin(acceptor_cpus);
+	}
 
-	// Start worker threads for this
-	auto logger = std::make_unique<Logger>(logpath);
-	RateLimiter globalrl(auths_per_second);
-	ConcurrentQueue<std::unique_ptr<FCGX_Request>> reqqueue;
+	// With an adaptive pool all the workers are started, those not needed
+	// wait at the gate (they keep their buffers for when they come back)
+	std::unique_ptr<WorkerGate> gate(adaptive ? new WorkerGate(nthreads) : nullptr);
 	std::vector<std::unique_ptr<AuthenticationServer>> workers;
-	for (int i = 0; i < nthreads; i++)
+	for (int i = 0; i < nworkers; i++) {
+		// In per_worker mode each worker accepts on the shared socket or its own
+		int wsock = !per_worker ? -1 : listen_socks[i % listen_socks.size()];
 		workers.emplace_back(new AuthenticationServer(
-			&reqqueue, secret, &globalrl, logger.get()));
+			reqqueue.get(), &reqpool, idle.get(), wsock, gate.get(), i, worker_cpus,
+			queue_deadline * 1000000ULL, &cookie_keys, compact_cookies, globalrl.get(), userrl.get(), gossiptable.get(), cookiecache.get(), revlist.get(),
+			&verifypool, logger.get(), audit.get(), &metrics));
+	}
+
+	// Event loops hand complete requests to the workers through the queue,
+	// when there's no room they reply with a 503 themselves.
+	auto dispatch = [&](AsyncRequest *areq) {
+		queued_req_t *request = reqpool.try_acquire();
+		mCounter rejected = ctQueueRejected;
+		if (request) {
+			request->async = areq;
+			request->accepted = mono_ns();
+			bool queued;
+			if (lanes) {
+				const char *uri = FCGX_GetParam("DOCUMENT_URI", areq->envp.data()) ?: "";
+				unsigned lane = strcmp(uri, "/auth") ? 1 : 0;
+				rejected = lane ? ctLaneOtherRejected : ctLaneAuthRejected;
+				queued = lanes->try_push(request, lane);
+			}
+			else
+				queued = reqqueue->offer(request);
+			if (queued)
+				return;
+			reqpool.release(request);
+		}
+		Response resp;
+		resp.add(resp_busy);
+		metrics.inc(rejected);
+		areq->respond(resp);
+	};
+	std::vector<std::unique_ptr<EventLoop>> loops;
+	for (int i = 0; epoll && i < event_threads; i++) {
+		loops.emplace_back(new EventLoop(listen_socks[i % listen_socks.size()], MAX_REQ_SIZE, keepalive_timeout, dispatch));
+		loops.back()->pin(acceptor_cpus, i);
+	}
+
+	std::unique_ptr<PoolScaler> scaler;
+	if (adaptive)
+		scaler.reset(new PoolScaler(gate.get(), &metrics, nthreads, max_threads,
+		                            scale_target_wait * 1000ULL, scale_interval));
 
-	std::cerr << "All workers up, serving until SIGINT/SIGTERM" << std::endl;
+	std::thread reload_thread(reloader, argv[1], webs_image, revlist.get(), &metrics, logger.get());
+
+	std::cerr << "All workers up, serving until SIGINT/SIGTERM (SIGHUP reloads webs)" << std::endl;
 
 	// Now keep ingesting incoming requests, we do this in the main
 	// thread since threads are much slower, unlikely to be a bottleneck.
-	while (serving) {
-		std::unique_ptr<FCGX_Request> request(new FCGX_Request());
-		FCGX_InitRequest(request.get(), 0, 0);
+	// Pinned only now, so that the threads started above don't inherit it.
+	pin_thread(pthread_self(), acceptor_cpus);
+	while (serving && (per_worker || epoll))
+		sleep(1);
+	while (serving && !per_worker && !epoll) {
+		// All of them might be held for a while (parked connections and a
+		// full queue), so wait for one only briefly to notice shutdowns.
+		queued_req_t *request = reqpool.acquire(std::chrono::milliseconds(100));
+		if (!request)
+			continue;
+		FCGX_InitRequest(&request->fcgx, lsock, 0);
+		request->async = nullptr;
+
+		if (FCGX_Accept_r(&request->fcgx) < 0) {
+			reqpool.release(request);
+			continue;
+		}
 
-		if (FCGX_Accept_r(request.get()) >= 0)
-			// Get a worker that's free and queue it there
-			reqqueue.push(std::move(request));
+		// Get a worker that's free and queue it there
+		enqueue(request);
 	}
 
 	std::cerr << "Signal caught! Starting shutdown" << std::endl;
-	reqqueue.close();
+	scaler.reset();
+	if (gate)
+		gate->close();
+	reqqueue->close();
+	reqpool.close();
 	workers.clear();
-	logger.release();
+	loops.clear();
+	idle.reset();
+	pthread_kill(reload_thread.native_handle(), SIGHUP);
+	reload_thread.join();
+	audit.reset();
+	logger.reset();
 
 	std::cerr << "All clear, service is down" << std::endl;
 }
@@ -0,0 +1,56 @@
+
+#ifndef __SHM__HH__
+#define __SHM__HH__
+
+#include <new>
+#include <cstddef>
+#include <sys/mman.h>
+
+// Anonymous shared memory mapping that objects are carved out of before
+// forking, so that every worker process sees (and updates) the same ones.
+// Allocations are cache line aligned and never freed, the whole arena goes
+// away with the last process using it.
+
+#define SHM_ALIGN    64
+
+class ShmArena {
+public:
+	ShmArena(size_t size) : size(size) {
+		base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (base == MAP_FAILED)
+			base = nullptr;
+	}
+
+	~ShmArena() {
+		if (base)
+			munmap(base, size);
+	}
+
+	bool valid() const { return base != nullptr; }
+
+	// Constructs n objects, returns nullptr when out of room
+	template<typename T>
+	T *alloc(size_t n = 1) {
+		size_t off = (used + SHM_ALIGN - 1) & ~(size_t)(SHM_ALIGN - 1);
+		if (!base || off + n * sizeof(T) > size)
+			return nullptr;
+		used = off + n * sizeof(T);
+		T *ret = (T*)((char*)base + off);
+		for (size_t i = 0; i < n; i++)
+			new (&ret[i]) T();
+		return ret;
+	}
+
+	// Bytes needed to hold n objects of type T (at most)
+	template<typename T>
+	static size_t need(size_t n = 1) {
+		return n * sizeof(T) + SHM_ALIGN;
+	}
+
+private:
+	void *base;
+	size_t size, used = 0;
+};
+
+#endif
+
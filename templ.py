@@ -4,31 +4,45 @@
 import os, re
 
 # Produce a usable header
-assetsh =  b"#include <string>\n#include <unordered_map>\n"
-assetsh += b"typedef std::string(*t_templatefn)(std::string, std::string, bool);\n"
-assetsh += b"extern const std::unordered_map<std::string, t_templatefn> templates;\n"
+assetsh =  b"#include <string>\n#include <vector>\n#include <unordered_map>\n"
+assetsh += b"enum t_segtype { segStatic, segHostname, segFollowPage, segLoginFailed };\n"
+assetsh += b"struct t_segment { t_segtype type; const char *data; unsigned len; };\n"
+assetsh += b"typedef std::vector<t_segment> t_template;\n"
+assetsh += b"extern const std::unordered_map<std::string, t_template> templates;\n"
 
-# Read template HTML files and generate templates.cc asset
+def cstr(b):
+	return b.replace(b"\\", b"\\\\").replace(b'"', b'\\"').replace(b"\n", b"\\n")
+
+def segment(stype, text = b""):
+	return b"  {%s, \"%s\", %d},\n" % (stype, cstr(text), len(text))
+
+# Read template HTML files and generate templates.cc asset, each template
+# is a list of segments: static text and slots to be filled at runtime.
 assets = b"#include \"templates.h\"\n#include <string>\n#include <unordered_map>\n\n"
 fnentries = []
 for i,f in enumerate(sorted(os.listdir("templates/"))):
 	if f.endswith(".html"):
 		cont = open(os.path.join("templates", f), "rb").read()
-		cont = cont.replace(b"\\", b"\\\\").replace(b'"', b'\\"').replace(b"\n", b"\\n")
-		cont = cont.replace(b"{{hostname}}", b'" + hostname + "')
-		cont = cont.replace(b"{{follow_page}}", b'" + follow_page + "')
-		cont = re.sub(b"{{loginfailed}}(.*){{/loginfailed}}", b'" + (err ? "\\1" : "") + "', cont)
-
-		assets += b"std::string login_%d(std::string hostname, std::string follow_page, bool err) {\n" % i
-		assets += b"return \"" + cont + b"\";\n}\n"
+		parts = re.split(b"({{hostname}}|{{follow_page}}|{{loginfailed}}.*{{/loginfailed}})", cont)
+
+		assets += b"static const t_template login_%d = {\n" % i
+		for p in parts:
+			if p == b"{{hostname}}":
+				assets += segment(b"segHostname")
+			elif p == b"{{follow_page}}":
+				assets += segment(b"segFollowPage")
+			elif p.startswith(b"{{loginfailed}}"):
+				assets += segment(b"segLoginFailed", p[len(b"{{loginfailed}}"):-len(b"{{/loginfailed}}")])
+			elif p:
+				assets += segment(b"segStatic", p)
+		assets += b"};\n"
 
 		fnentries.append(b"  {\"%s\", %s},\n" % (f.split(".")[0].encode("utf-8"), b"login_%d" % i))
 
-# Generate a map of functions indexed on template name
-assets += b"const std::unordered_map<std::string, t_templatefn> templates = {\n"
+# Generate a map of templates indexed on template name
+assets += b"const std::unordered_map<std::string, t_template> templates = {\n"
 assets += b"".join(fnentries)
 assets += b"};"
 open("templates.cc", "wb").write(assets)
 open("templates.h", "wb").write(assetsh)
 
-
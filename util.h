@@ -1,18 +1,36 @@
 
+#ifndef __UTIL__HH__
+#define __UTIL__HH__
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
 #include <openssl/sha.h>
 #include <openssl/hmac.h>
 #include <openssl/rand.h>
 
-static const char hexcharset[] = "0123456789abcdef";
-static std::string hexencode(std::string s) {
-	std::string ret;
-	for (char c : s) {
-		ret.push_back(hexcharset[(c >> 4) & 15]);
-		ret.push_back(hexcharset[c & 15]);
-	}
-	return ret;
+#include "codec.h"
+
+// Restricts a thread to some cpus: all of them, or only the idx-th one
+// (round robin) if idx is not negative. Memory a thread touches first is
+// placed on its node, so pinning before allocating keeps its state local.
+static inline int pin_thread(pthread_t t, const std::vector<int> &cpus, int idx = -1) {
+	if (cpus.empty())
+		return 0;
+	cpu_set_t cs;
+	CPU_ZERO(&cs);
+	if (idx >= 0)
+		CPU_SET(cpus[idx % cpus.size()], &cs);
+	else
+		for (int c : cpus)
+			CPU_SET(c, &cs);
+	return pthread_setaffinity_np(t, sizeof(cs), &cs);
 }
-static unsigned char hexdec(char c) {
+
+static inline unsigned char hexdec(char c) {
 	if (c >= '0' && c <= '9')
 		return c - '0';
 	else if (c >= 'a' && c <= 'f')
@@ -21,23 +39,14 @@ static unsigned char hexdec(char c) {
 		return c - 'A' + 10;
 	return 0;
 }
-static std::string hexdecode(std::string s) {
-	if (s.size() & 1)
-		return {};
-	std::string ret;
-	for (unsigned i = 0; i < s.size(); i += 2)
-		ret.push_back((char)((hexdec(s[i]) << 4) | hexdec(s[i+1])));
-	return ret;
-}
-
-static std::string b32pad(std::string s) {
+static inline std::string b32pad(std::string s) {
 	unsigned pn = (8 - (s.size() & 7)) & 7;
 	while (pn--)
 		s.push_back('=');
 	return s;
 }
 
-static std::string b32dec(std::string s) {
+static inline std::string b32dec(std::string s) {
 	std::string ret;
 	uint64_t ac = 0;
 	for (unsigned i = 0; i < s.size(); i++) {
@@ -65,89 +74,165 @@ static std::string b32dec(std::string s) {
 	return ret;
 }
 
-static std::string trim(const std::string &s) {
+// Request parsing, these work on views of the request buffers and only
+// allocate when the caller needs to own the result (the plain reference
+// versions are in bench/reference.h).
+
+static inline std::string_view trimsv(std::string_view s) {
 	auto ps = s.find_first_not_of(' ');
-	if (ps == std::string::npos)
+	if (ps == std::string_view::npos)
 		return {};
 	auto pe = s.find_last_not_of(' ');
 	return s.substr(ps, pe + 1 - ps);
 }
 
-static std::string urldec(const std::string &s) {
-	std::string ret;
-	for (unsigned i = 0; i < s.size(); i++) {
+// Decodes hex into a buffer, returns the number of bytes or -1 on error
+static inline int hexdecode(std::string_view s, uint8_t *out, size_t maxlen) {
+	if ((s.size() & 1) || s.size() / 2 > maxlen)
+		return -1;
+	hexdecode_raw(s.data(), s.size() / 2, out);
+	return s.size() / 2;
+}
+
+// Same as hexdecode() but reuses the output string storage
+static inline void hexdecode(std::string_view s, std::string *out) {
+	out->clear();
+	if (s.size() & 1)
+		return;
+	out->resize(s.size() / 2);
+	hexdecode_raw(s.data(), s.size() / 2, (uint8_t*)&(*out)[0]);
+}
+
+static inline std::string hexencodesv(std::string_view s) {
+	std::string ret(s.size() * 2, 0);
+	hexencode_raw((const uint8_t*)s.data(), s.size(), &ret[0]);
+	return ret;
+}
+
+// Matches an url-encoded string against a plain one, without decoding it
+static inline bool urlmatch(std::string_view enc, std::string_view plain) {
+	unsigned j = 0;
+	for (unsigned i = 0; i < enc.size(); i++, j++) {
+		char c = enc[i];
+		if (c == '%' && i + 2 < enc.size()) {
+			c = (char)((hexdec(enc[i+1]) << 4) | hexdec(enc[i+2]));
+			i += 2;
+		}
+		if (j >= plain.size() || plain[j] != c)
+			return false;
+	}
+	return j == plain.size();
+}
+
+static inline std::string urldecsv(std::string_view s) {
+	std::string ret(s.size(), 0);
+	size_t n = 0;
+	for (size_t i = 0; i < s.size(); i++) {
 		if (s[i] == '%' && i + 2 < s.size()) {
-			ret += hexdecode(s.substr(i+1, 2));
+			ret[n++] = (char)((hexdec(s[i+1]) << 4) | hexdec(s[i+2]));
 			i += 2;
 		}
 		else
-			ret.push_back(s[i]);
+			ret[n++] = s[i];
 	}
+	ret.resize(n);
 	return ret;
 }
 
-static std::unordered_map<std::string, std::string> parse_cookies(std::string jar) {
-	std::unordered_map<std::string, std::string> cookies;
-	size_t p = 0;
+// Returns the value of a cookie (or empty), the last one wins like in parse_cookies
+static inline std::string_view find_cookie(std::string_view jar, std::string_view name) {
+	std::string_view ret;
 	while (1) {
-		size_t pe = jar.find(';', p);
-		std::string curc = pe != std::string::npos ? jar.substr(p, pe - p) : jar.substr(p);
+		size_t pe = jar.find(';');
+		std::string_view curc = jar.substr(0, pe);
 		size_t peq = curc.find('=');
-		if (peq != std::string::npos)
-			cookies[trim(curc.substr(0, peq))] = trim(curc.substr(peq+1));
-		if (pe == std::string::npos)
+		if (peq != std::string_view::npos && trimsv(curc.substr(0, peq)) == name)
+			ret = trimsv(curc.substr(peq+1));
+		if (pe == std::string_view::npos)
 			break;
-		p = pe + 1;
+		jar.remove_prefix(pe + 1);
 	}
-
-	return cookies;
+	return ret;
 }
 
-static std::unordered_map<std::string, std::string> parse_vars(std::string body) {
-	std::unordered_map<std::string, std::string> vars;
-	size_t p = 0;
+// Returns the decoded value of a variable (or empty), the last one wins like in parse_vars
+static inline std::string find_var(std::string_view body, std::string_view name) {
+	std::string_view ret;
 	while (1) {
-		size_t pe = body.find('&', p);
-		std::string curv = pe != std::string::npos ? body.substr(p, pe - p) : body.substr(p);
+		size_t pe = body.find('&');
+		std::string_view curv = body.substr(0, pe);
 		size_t peq = curv.find('=');
-		if (peq != std::string::npos)
-			vars[urldec(curv.substr(0, peq))] = urldec(curv.substr(peq+1));
-		if (pe == std::string::npos)
+		if (peq != std::string_view::npos && urlmatch(curv.substr(0, peq), name))
+			ret = curv.substr(peq+1);
+		if (pe == std::string_view::npos)
 			break;
-		p = pe + 1;
+		body.remove_prefix(pe + 1);
 	}
-
-	return vars;
+	return urldecsv(ret);
 }
 
-static std::string hmac_sha1(std::string key, std::string msg) {
-	uint8_t hash[EVP_MAX_MD_SIZE];
-	unsigned hsize = sizeof(hash);
-	HMAC(EVP_sha1(), key.c_str(), key.size(), (uint8_t*)msg.c_str(), msg.size(), hash, &hsize);
-	return std::string((char*)hash, hsize);
-}
+// Base64url (RFC 4648 section 5) without padding
+static const char b64urlcharset[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
 
-static std::string hmac_sha256(std::string key, std::string msg) {
-	uint8_t hash[EVP_MAX_MD_SIZE];
-	unsigned hsize = sizeof(hash);
-	HMAC(EVP_sha256(), key.c_str(), key.size(), (uint8_t*)msg.c_str(), msg.size(), hash, &hsize);
-	return std::string((char*)hash, hsize);
+static inline std::string b64urlencode(const uint8_t *data, size_t len) {
+	std::string ret;
+	ret.reserve((len * 4 + 2) / 3);
+	uint32_t ac = 0;
+	unsigned bits = 0;
+	for (size_t i = 0; i < len; i++) {
+		ac = (ac << 8) | data[i];
+		bits += 8;
+		while (bits >= 6) {
+			bits -= 6;
+			ret.push_back(b64urlcharset[(ac >> bits) & 63]);
+		}
+	}
+	if (bits)
+		ret.push_back(b64urlcharset[(ac << (6 - bits)) & 63]);
+	return ret;
 }
 
-static std::string hmac_sha512(std::string key, std::string msg) {
-	uint8_t hash[EVP_MAX_MD_SIZE];
-	unsigned hsize = sizeof(hash);
-	HMAC(EVP_sha512(), key.c_str(), key.size(), (uint8_t*)msg.c_str(), msg.size(), hash, &hsize);
-	return std::string((char*)hash, hsize);
+// Value of every char plus one (0 for chars not in the charset)
+struct b64urlvalues_t {
+	uint8_t v[256];
+	constexpr b64urlvalues_t() : v() {
+		for (unsigned i = 0; i < 64; i++)
+			v[(uint8_t)b64urlcharset[i]] = i + 1;
+	}
+};
+static constexpr b64urlvalues_t b64urlvalues;
+
+// Decodes into a buffer, returns the number of bytes or -1 on error. Only
+// the canonical encoding is accepted (the spare bits of the last char must
+// be zero), so that some data has exactly one valid encoding.
+static inline int b64urldecode(std::string_view s, uint8_t *out, size_t maxlen) {
+	if ((s.size() & 3) == 1 || s.size() * 3 / 4 > maxlen)
+		return -1;
+	uint32_t ac = 0;
+	unsigned bits = 0, n = 0;
+	for (char c : s) {
+		unsigned v = b64urlvalues.v[(uint8_t)c];
+		if (!v)
+			return -1;
+		ac = (ac << 6) | (v - 1);
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			out[n++] = (ac >> bits) & 255;
+		}
+	}
+	if (ac & ((1U << bits) - 1))
+		return -1;
+	return n;
 }
 
-static std::string randstr() {
+static inline std::string randstr() {
 	char buf[256];
 	RAND_bytes((uint8_t*)buf, sizeof(buf));
 	return std::string(buf, sizeof(buf));
 }
 
-static std::string stripnl(const std::string &s) {
+static inline std::string stripnl(const std::string &s) {
 	std::string ret;
 	for (char c : s)
 		if (c != '\n' && c != '\r')
@@ -155,4 +240,14 @@ static std::string stripnl(const std::string &s) {
 	return ret;
 }
 
+// Hint the CPU we are busy-waiting
+static inline void cpu_relax() {
+	#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+	#elif defined(__aarch64__)
+	asm volatile("yield");
+	#endif
+}
+
+#endif
 